@@ -30,15 +30,57 @@
  * @{
  */
 
+#define FAT_OPT_SINGLE_FAT  0x01 ///< Don't mirror the FAT to other copies (see FAT_SetMountOptions)
+#define FAT_OPT_JOURNAL     0x02 ///< Make appends atomic with an append journal (see FAT_SetMountOptions)
+
+/**
+ * @brief Directory entry returned by FAT_ReadDir
+ */
+typedef struct {
+  char name[13];          ///< Zero ended name, e.g. "DATA.BIN"
+  uint8_t attributes;     ///< Attributes. 0x01 - read only, 0x02 - hidden, 0x04 - system, 0x10 - directory, 0x20 - archive
+  uint32_t size;          ///< Size of file in bytes
+  uint32_t firstCluster;  ///< First cluster of file, 0 if empty
+} FAT_DirInfo;
+
+void FAT_SetMountOptions(uint32_t options);
 int8_t FAT_Init(void (*phyInit)(void),
     uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
     uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count));
+int FAT_Mount(void (*phyInit)(void),
+    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t partition);
+int FAT_Unmount(int volume);
 
 int FAT_OpenFile(const char* filename);
+int FAT_NewFile(const char* filename);
+int FAT_DeleteFile(const char* filename);
+int FAT_CloseFile(int file);
+int FAT_Sync(int file);
 int FAT_ReadFile(int file, uint8_t* data, int count);
 int FAT_MoveRdPtr(int file, int newWrPtr);
 int FAT_MoveWrPtr(int file, int newWrPtr);
 int FAT_WriteFile(int file, const uint8_t* data, int count);
+int FAT_SetClusterMap(int file, uint32_t* table, uint32_t size);
+int FAT_Preallocate(int file, uint32_t bytes);
+int FAT_Truncate(int file, uint32_t size);
+int FAT_AttachFileBuffer(int file);
+int FAT_OpenRing(const char* filename, uint32_t size, uint16_t recordSize);
+int FAT_RingWrite(int ring, const uint8_t* data);
+int FAT_RingRead(int ring, uint8_t* data);
+int FAT_RingRewind(int ring);
+int FAT_CloseRing(int ring);
+int FAT_OpenDir(const char* path);
+int FAT_ReadDir(int dir, FAT_DirInfo* info);
+int FAT_CloseDir(int dir);
+int FAT_GetCacheStats(int volume, uint32_t* hits, uint32_t* misses);
+int FAT_GetFATCacheStats(int volume, uint32_t* hits, uint32_t* misses);
+int FAT_GetFree(int volume, uint32_t* freeClusters, uint32_t* clusterSize);
+void FAT_SetTimeCallback(uint32_t (*getTime)(void));
+int FAT_SetGatherWrite(int volume,
+    uint8_t (*phyWriteSectorsV)(uint8_t* const* bufs, uint32_t sector,
+    uint32_t count));
 
 /**
  * @}
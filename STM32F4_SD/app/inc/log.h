@@ -0,0 +1,101 @@
+/**
+ * @file    log.h
+ * @brief   Compile-time leveled debug output.
+ *
+ * Every module picks its own level and tag before including
+ * this header, e.g.:
+ *
+ * @code
+ * #ifndef FAT_LOG_LEVEL
+ *   #define FAT_LOG_LEVEL LOG_LEVEL_DEFAULT
+ * #endif
+ * #define LOG_LEVEL FAT_LOG_LEVEL
+ * #define LOG_TAG   "FAT"
+ * #include <log.h>
+ * @endcode
+ *
+ * Messages above the module level are removed by the preprocessor,
+ * so they cost neither code nor time. Per sector and per call messages
+ * use LOG_TRACE, so with any level below LOG_LEVEL_TRACE the I/O path
+ * contains no printf calls at all.
+ *
+ * @verbatim
+ * This program is made available under the terms
+ * of the GNU Public License v3.0 which accompanies
+ * this distribution, and is available at
+ * http://www.gnu.org/licenses/gpl.html
+ * @endverbatim
+ */
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+
+/**
+ * @defgroup  LOG LOG
+ * @brief     Leveled debug output
+ */
+
+/**
+ * @addtogroup LOG
+ * @{
+ */
+
+#define LOG_LEVEL_NONE  0 ///< No output at all
+#define LOG_LEVEL_ERROR 1 ///< Failures
+#define LOG_LEVEL_WARN  2 ///< Recoverable problems
+#define LOG_LEVEL_INFO  3 ///< One-off events (init, open, card info)
+#define LOG_LEVEL_TRACE 4 ///< Per call and per sector messages
+
+/*
+ * Level for modules which don't set their own. Can be
+ * overridden for the whole build with -DLOG_LEVEL_DEFAULT=...
+ */
+#ifndef LOG_LEVEL_DEFAULT
+  #define LOG_LEVEL_DEFAULT LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_TAG
+  #define LOG_TAG "LOG"
+#endif
+
+/**
+ * @brief Checks in preprocessor conditionals whether a level is compiled in.
+ * Useful for guarding multi-line dumps.
+ */
+#define LOG_ENABLED(level) (LOG_LEVEL >= (level))
+
+#if LOG_ENABLED(LOG_LEVEL_ERROR)
+  #define LOG_ERROR(str, args...) printf(LOG_TAG"--> "str"%s",##args,"\r\n")
+#else
+  #define LOG_ERROR(str, args...) (void)0
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_WARN)
+  #define LOG_WARN(str, args...) printf(LOG_TAG"--> "str"%s",##args,"\r\n")
+#else
+  #define LOG_WARN(str, args...) (void)0
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_INFO)
+  #define LOG_INFO(str, args...) printf(LOG_TAG"--> "str"%s",##args,"\r\n")
+#else
+  #define LOG_INFO(str, args...) (void)0
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_TRACE)
+  #define LOG_TRACE(str, args...) printf(LOG_TAG"--> "str"%s",##args,"\r\n")
+#else
+  #define LOG_TRACE(str, args...) (void)0
+#endif
+
+/**
+ * @}
+ */
+
+#endif /* LOG_H_ */
@@ -34,6 +34,7 @@ void    SD_Init         (void);
 uint8_t SD_ReadBlock    (uint32_t block, uint8_t* buf);
 uint8_t SD_ReadSectors  (uint8_t* buf, uint32_t sector, uint32_t count);
 uint8_t SD_WriteSectors (uint8_t* buf, uint32_t sector, uint32_t count);
+uint8_t SD_WriteSectorsV(uint8_t* const* bufs, uint32_t sector, uint32_t count);
 uint64_t SD_ReadCapacity(void);
 
 /**
@@ -32,21 +32,19 @@
 
 void softTimerCallback(void);
 
-#define DEBUG
-
-#ifdef DEBUG
-#define print(str, args...) printf(""str"%s",##args,"")
-#define println(str, args...) printf("MAIN--> "str"%s",##args,"\r\n")
-#else
-#define print(str, args...) (void)0
-#define println(str, args...) (void)0
+#ifndef MAIN_LOG_LEVEL
+  #define MAIN_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
+#define LOG_LEVEL MAIN_LOG_LEVEL
+#define LOG_TAG   "MAIN"
+#include <log.h>
+
 
 int main(void) {
 
   COMM_Init(COMM_BAUD_RATE); // initialize communication with PC
-  println("Starting program"); // Print a string to terminal
+  LOG_INFO("Starting program"); // Print a string to terminal
 
   TIMER_Init(SYSTICK_FREQ); // Initialize timer
 
@@ -70,6 +68,7 @@ int main(void) {
   uint32_t softTimer = TIMER_GetTime(); // get start time for delay
 
   FAT_Init(SD_Init, SD_ReadSectors, SD_WriteSectors);
+  FAT_SetGatherWrite(0, SD_WriteSectorsV);
 
 //  int hello = FAT_OpenFile("HELLO   TXT");
 //  uint8_t data[100];
@@ -108,7 +107,7 @@ int main(void) {
 
     // check for new frames from PC
     if (!COMM_GetFrame(buf, &len)) {
-      println("Got frame of length %d: %s", (int)len, (char*)buf);
+      LOG_INFO("Got frame of length %d: %s", (int)len, (char*)buf);
 
       // control LED0 from terminal
       if (!strcmp((char*)buf, ":LED0 ON")) {
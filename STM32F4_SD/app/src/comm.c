@@ -21,17 +21,13 @@
 #include <uart2.h>
 #include <stdio.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef COMM_LOG_LEVEL
+  #define COMM_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf("COMM--> "str"%s",##args,"\r")
-  #define println(str, args...) printf("COMM--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL COMM_LOG_LEVEL
+#define LOG_TAG   "COMM"
+#include <log.h>
 
 /**
  * @addtogroup COMM
@@ -132,7 +128,7 @@ uint8_t COMM_GetFrame(uint8_t* buf, uint8_t* len) {
       // no more data and terminator wasn't reached => error
       if (FIFO_IsEmpty(&rxFifo)) {
         *len = 0;
-        println("Invalid frame");
+        LOG_ERROR("Invalid frame");
         return 2;
       }
       FIFO_Pop(&rxFifo, &c);
@@ -19,18 +19,15 @@
 #include <stdio.h>
 #include <utils.h>
 #include <string.h>
+#include <timers.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef FAT_LOG_LEVEL
+  #define FAT_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf(""str"%s",##args,"")
-  #define println(str, args...) printf("FAT--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL FAT_LOG_LEVEL
+#define LOG_TAG   "FAT"
+#include <log.h>
 
 /**
  * @addtogroup FAT
@@ -62,6 +59,7 @@ typedef enum {
   PAR_TYPE_FAT16 = 0x06,    //!< PAR_TYPE_FAT16
   PAR_TYPE_NTFS = 0x07,     //!< PAR_TYPE_NTFS
   PAR_TYPE_FAT32 = 0x0b,    //!< PAR_TYPE_FAT32
+  PAR_TYPE_FAT32_LBA = 0x0c,//!< PAR_TYPE_FAT32_LBA
 
 } FAT_PartitonType;
 /**
@@ -120,7 +118,7 @@ typedef struct {
   uint32_t  totalSectors32;    ///< New 32-bit count of sectors on volume (optional in FAT12/16)
 
   uint32_t  sectorsPerFAT32;   ///< Number of sectors occupied by one FAT.
-  uint16_t  flags;             ///<
+  uint16_t  flags;             ///< Bit 7 set - only the FAT given by bits 0-3 is active, otherwise all FATs are mirrored
   uint16_t  fsVersion;         ///< Version number. High byte - major revision. Low byte - minor revision.
   uint32_t  rootCluster;       ///< Cluster number of the first cluster of the root directory - usually 2
   uint16_t  fsInfo;            ///< Sector number of the FSINFO structure in the reserved area of the FAT32 volume - usually 1.
@@ -135,6 +133,20 @@ typedef struct {
   uint8_t   bootcode[420];     ///< Bootloader code
   uint16_t  signature;         ///< Boot signature 0xaa55
 } __attribute((packed)) FAT32_BootSector;
+/**
+ * @brief FAT32 FSInfo sector
+ *
+ * @details Both counters are only hints, 0xffffffff means unknown.
+ */
+typedef struct {
+  uint32_t  leadSignature;     ///< Lead signature 0x41615252
+  uint8_t   reserved[480];
+  uint32_t  structSignature;   ///< Structure signature 0x61417272
+  uint32_t  freeCount;         ///< Last known number of free clusters
+  uint32_t  nextFree;          ///< Cluster where to start looking for free clusters
+  uint8_t   reserved1[12];
+  uint32_t  trailSignature;    ///< Trail signature 0xaa550000
+} __attribute((packed)) FAT_FSInfo;
 /**
  * @brief Root directory entry (32 bytes long)
  */
@@ -197,6 +209,35 @@ typedef union {
     uint16_t hours: 5;
   } fields;
 } FAT_TimeFormat;
+/**
+ * @brief Sector cache entry
+ */
+typedef struct {
+  uint32_t sector;    ///< Sector held in this entry, UINT32_MAX if entry is empty
+  uint32_t lastUsed;  ///< Access stamp used for LRU replacement
+  uint8_t dirty;      ///< Entry was modified and not yet written to the card
+  uint8_t buf[512] __attribute((aligned(4))); ///< Sector data
+} FAT_CacheEntry;
+/**
+ * @brief Iterator over physically contiguous sector runs of a cluster chain
+ *
+ * @details Files keep one iterator for the read and one for the write
+ * pointer, so consecutive transfers don't have to walk the cluster chain.
+ * The next sector of the iterator is sectorOffset sectors into cluster
+ * number index of the file. If sectorOffset equals the number of sectors
+ * per cluster, the iterator is at the end of the cluster and the next
+ * cluster is taken from the FAT only when more sectors are requested.
+ * Clusters in the contiguous part at the start of the file are found
+ * without looking at the FAT or the cluster map.
+ */
+typedef struct {
+  uint32_t cluster;       ///< Cluster the iterator is at
+  uint32_t sectorOffset;  ///< Sector in the cluster
+  uint32_t index;         ///< Index of the cluster in the file
+  const uint32_t* map;    ///< Cluster map of the file, 0 if not used
+  uint32_t firstCluster;  ///< First cluster of the file
+  uint32_t contiguous;    ///< Number of adjacent clusters at the start of the file
+} FAT_Extent;
 /**
  * @brief Structure for keeping file information
  */
@@ -207,12 +248,67 @@ typedef struct {
   uint8_t attributes;         ///< Attributes of file
   uint16_t lastModifiedTime;  ///< Last modified time of file
   uint16_t lastModifiedDate;  ///< Last modified date of file
-  uint32_t rootDirEntry;      ///< Number of root dir entry for file
+  uint32_t dirSector;         ///< Sector holding the directory entry of the file
+  uint32_t dirIndex;          ///< Number of the directory entry in its sector
   int id;                     ///< File ID
+  uint8_t volume;             ///< ID of the volume holding the file
   uint32_t wrPtr;             ///< Pointer to current write location
   uint32_t rdPtr;             ///< Pointer to current read location
+  FAT_Extent rdCursor;        ///< Position of read pointer in cluster chain
+  FAT_Extent wrCursor;        ///< Position of write pointer in cluster chain
+  uint32_t* clusterMap;       ///< Run-length encoded cluster map (fast seek), 0 if not used
+  uint32_t clusterMapSize;    ///< Size of cluster map table in 32-bit words
+  int8_t clusterMapPool;      ///< Pool table used for cluster map, -1 if table supplied by user
+  FAT_CacheEntry* buffer;     ///< Private sector buffer, 0 if file uses the shared cache
+  uint32_t contiguous;        ///< Number of clusters at the start of the file known to be adjacent
+  uint8_t entryDirty;         ///< Size, first cluster or time changed since the directory entry was updated
+  uint32_t entryBytes;        ///< Bytes written since the directory entry was updated
+  uint32_t entrySince;        ///< Time of the oldest change not stored in the directory entry
 
 } FAT_File;
+/**
+ * @brief Slot of the directory name index
+ */
+typedef struct {
+  uint32_t sector;  ///< Sector holding the entry, 0 - empty slot, UINT32_MAX - removed entry
+  uint16_t hash;    ///< Hash of the 8.3 name
+  uint8_t index;    ///< Number of the entry in its sector
+} FAT_DirIndexSlot;
+/**
+ * @brief Position in the cluster chain of a directory
+ */
+typedef struct {
+  uint32_t first;   ///< First cluster of the directory
+  uint32_t cluster; ///< Cluster the walk is at
+  uint32_t index;   ///< Index of the cluster in the directory, UINT32_MAX before the first access
+} FAT_DirWalk;
+/**
+ * @brief Header sector of a ring file
+ */
+typedef struct {
+  uint32_t signature;   ///< FAT_RING_SIGNATURE
+  uint32_t recordSize;  ///< Size of a record in bytes, without its stamp
+  uint32_t slots;       ///< Number of records the ring holds
+  uint32_t head;        ///< Sequence number of the next record
+  uint32_t tail;        ///< Sequence number of the oldest record
+} FAT_RingHeader;
+/**
+ * @brief Opened ring file
+ *
+ * @details Records are stored in slots following the header sector,
+ * record n in slot n % slots. Each slot starts with a stamp (record
+ * number plus one), so records written after the last header update
+ * are found when the ring is opened again.
+ */
+typedef struct {
+  int file;             ///< ID of the ring file, -1 if not used
+  uint32_t recordSize;  ///< Size of a record in bytes, without its stamp
+  uint32_t slots;       ///< Number of records the ring holds
+  uint32_t head;        ///< Sequence number of the next record
+  uint32_t tail;        ///< Sequence number of the oldest record
+  uint32_t next;        ///< Sequence number of the next record to read
+  uint32_t unsaved;     ///< Records written since the header was updated
+} FAT_Ring;
 /**
  * @brief Structure containing info about partition structure
  *
@@ -226,19 +322,21 @@ typedef struct {
   uint32_t startAddress;      ///< Start address - LBA sector number
   uint32_t length;            ///< Length of partition in sectors
   uint32_t startFatSector;    ///< Sector where FAT start
+  uint32_t sectorsPerFAT;     ///< Number of sectors occupied by one FAT
+  uint32_t numberOfFATs;      ///< Number of FAT copies
+  uint8_t mirrored;           ///< 1 - changes are copied to all FATs, 0 - only one FAT is used
+  uint32_t mirrorSectors;     ///< FAT sectors covered by one bit of the mirror map
+  uint32_t clusterCount;      ///< Number of data clusters (clusters 2 to clusterCount+1)
+  uint32_t nextFreeCluster;   ///< Where to start searching for a free cluster (next-fit)
+  uint32_t freeClusters;      ///< Number of free clusters, UINT32_MAX if unknown
+  uint32_t fsInfoSector;      ///< Sector of the FSInfo structure, 0 if there is none
+  uint8_t fsInfoDirty;        ///< Free cluster count or hint changed since FSInfo was written
   uint32_t rootDirSector;     ///< Sector where root directory starts
   uint32_t rootDirCluster;    ///< First cluster of root directory
   uint32_t dataStartSector;   ///< Sector where data starts
   uint32_t sectorsPerCluster; ///< Number of sectors per cluster
   uint32_t bytesPerSector;    ///< Number of bytes per sector
 } FAT_PartitionInfo;
-/**
- * @brief Structure containing info about disk structure
- */
-typedef struct {
-  uint8_t diskID;
-  FAT_PartitionInfo partitionInfo[4];
-} FAT_DiskInfo;
 /**
  * @brief Physical layer callbacks.
  */
@@ -246,11 +344,251 @@ typedef struct {
   void (*phyInit)(void);
   uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count);
   uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count);
+  uint8_t (*phyWriteSectorsV)(uint8_t* const* bufs, uint32_t sector, uint32_t count); ///< Optional
 } FAT_PhysicalCb;
 
-#define FAT_MAX_DISKS     2   ///< Maximum number of mounted disks
+#ifndef FAT_MAX_VOLUMES
+  #define FAT_MAX_VOLUMES 2   ///< Maximum number of mounted volumes (at most 10)
+#endif
 #define MAX_OPENED_FILES  32  ///< Maximum number of opened files
 #define FAT_LAST_CLUSTER  0x0fffffff ///< Last cluster in file
+#define FAT_ENTRY_MASK    0x0fffffff ///< Only lower 28 bits of FAT32 entry are valid
+#define FAT_IS_EOC(cluster) ((cluster) >= 0x0ffffff8) ///< Is cluster an end of chain marker
+
+#ifndef FAT_CACHE_SECTORS
+  #define FAT_CACHE_SECTORS 8 ///< Number of sectors kept in the sector cache (4-32)
+#endif
+#ifndef FAT_FILE_BUFFERS
+  #define FAT_FILE_BUFFERS  2 ///< Number of private sector buffers for opened files
+#endif
+#ifndef FAT_WRITE_BACK
+  #define FAT_WRITE_BACK    1 ///< 1 - keep written sectors in cache until flushed, 0 - write through
+#endif
+#ifndef FAT_FLUSH_AGE_MS
+  #define FAT_FLUSH_AGE_MS  1000 ///< Flush cache when oldest dirty sector is older than this (0 - never)
+#endif
+#ifndef FAT_FLUSH_BYTES
+  #define FAT_FLUSH_BYTES   0 ///< Flush cache after this many bytes were written (0 - never)
+#endif
+#ifndef FAT_MAX_TRANSFER
+  #define FAT_MAX_TRANSFER  64 ///< Maximum number of sectors in one multi-sector transfer
+#endif
+#define FAT_CACHE_ENTRIES (FAT_CACHE_SECTORS + FAT_FILE_BUFFERS) ///< Shared and private cache entries
+#ifndef FAT_FAT_CACHE_LINES
+  #define FAT_FAT_CACHE_LINES     2 ///< Number of lines in the FAT cache
+#endif
+#ifndef FAT_FAT_CACHE_PREFETCH
+  #define FAT_FAT_CACHE_PREFETCH  2 ///< Number of FAT sectors read into a line at once (1-32)
+#endif
+#ifndef FAT_CLUSTER_MAP_POOL
+  #define FAT_CLUSTER_MAP_POOL  4 ///< Number of cluster map tables in the pool
+#endif
+#ifndef FAT_CLUSTER_MAP_WORDS
+  #define FAT_CLUSTER_MAP_WORDS 34 ///< Size of a pool cluster map table in words (16 runs)
+#endif
+#ifndef FAT_FREE_MAP_CLUSTERS
+  #define FAT_FREE_MAP_CLUSTERS 4096 ///< Clusters in a free bitmap segment (multiple of 128)
+#endif
+#ifndef FAT_FREE_SEGMENTS
+  #define FAT_FREE_SEGMENTS     1024 ///< Number of segments tracked in the free space summary
+#endif
+#ifndef FAT_ENTRY_COMMIT_BYTES
+  #define FAT_ENTRY_COMMIT_BYTES  0 ///< Update directory entry after this many bytes were written (0 - only on sync)
+#endif
+#ifndef FAT_ENTRY_COMMIT_MS
+  #define FAT_ENTRY_COMMIT_MS     1000 ///< Update directory entry when oldest change is older than this (0 - only on sync)
+#endif
+#ifndef FAT_MIRROR_MAP_BITS
+  #define FAT_MIRROR_MAP_BITS     1024 ///< Bits tracking FAT sectors not yet copied to other FATs (multiple of 32)
+#endif
+#ifndef FAT_JOURNAL_NAME
+  #define FAT_JOURNAL_NAME        "JOURNAL SYS" ///< File in the root directory holding the append journal
+#endif
+#define FAT_JOURNAL_FILES     4 ///< Files described by the journal
+#define FAT_JOURNAL_RUNS      8 ///< Runs of new clusters described per file
+#define FAT_JOURNAL_SIGNATURE 0x4c4e524a ///< "JRNL"
+#ifndef FAT_MAX_RINGS
+  #define FAT_MAX_RINGS           2 ///< Maximum number of opened ring files
+#endif
+#ifndef FAT_RING_HEADER_RECORDS
+  #define FAT_RING_HEADER_RECORDS 64 ///< Update ring header after this many records
+#endif
+#define FAT_RING_SIGNATURE    0x474e4952 ///< "RING"
+#ifndef FAT_DIR_INDEX_SLOTS
+  #define FAT_DIR_INDEX_SLOTS     512 ///< Slots of a directory name index (power of 2, at most 3/4 are used), 8 bytes each
+#endif
+#ifndef FAT_DIR_INDEXES
+  #define FAT_DIR_INDEXES         2 ///< Directories indexed at a time per volume
+#endif
+#ifndef FAT_PATH_CACHE_ENTRIES
+  #define FAT_PATH_CACHE_ENTRIES  4 ///< Directories remembered by path lookup
+#endif
+#ifndef FAT_PATH_CACHE_LENGTH
+  #define FAT_PATH_CACHE_LENGTH   32 ///< Longest directory path remembered (with terminating zero)
+#endif
+#define FAT_DIR_MAX_ENTRIES   65536 ///< Maximum number of entries in a directory
+#ifndef FAT_MAX_DIRS
+  #define FAT_MAX_DIRS            1 ///< Maximum number of opened directories
+#endif
+#ifndef FAT_DIR_READ_SECTORS
+  #define FAT_DIR_READ_SECTORS    8 ///< Directory sectors read at once when listing (a whole cluster if it's smaller)
+#endif
+
+/**
+ * @brief Journal record of a file appended to since the last commit
+ *
+ * @details Holds the state of the file as last committed to the card
+ * and the clusters allocated to it since then, which is all that's
+ * needed to roll the append back.
+ */
+typedef struct {
+  uint32_t dirSector;     ///< Sector holding the directory entry of the file
+  uint32_t dirIndex;      ///< Number of the directory entry in its sector
+  uint32_t firstCluster;  ///< First cluster at the last commit
+  uint32_t fileSize;      ///< Size at the last commit
+  uint32_t lastCluster;   ///< Last cluster at the last commit (0 - empty file), UINT32_MAX if nothing was allocated
+  uint32_t runs;          ///< Number of runs of new clusters
+  uint32_t run[FAT_JOURNAL_RUNS][2]; ///< First cluster and length of each run
+} FAT_JournalFile;
+/**
+ * @brief Append journal sector
+ *
+ * @details The sector is written before any FAT or directory sector
+ * of an open transaction reaches the card, and written empty once
+ * the transaction is committed. A record found at mount is rolled back.
+ */
+typedef struct {
+  uint32_t signature;     ///< FAT_JOURNAL_SIGNATURE
+  uint32_t sequence;      ///< Incremented with every write of the journal
+  uint32_t files;         ///< Number of files in the transaction, 0 - nothing to roll back
+  FAT_JournalFile file[FAT_JOURNAL_FILES]; ///< Files appended to
+  uint8_t reserved[496 - FAT_JOURNAL_FILES * sizeof(FAT_JournalFile)];
+  uint32_t checksum;      ///< Sum of all preceding words
+} FAT_Journal;
+/**
+ * @brief Path lookup cache entry
+ */
+typedef struct {
+  char path[FAT_PATH_CACHE_LENGTH]; ///< Directory path as given by the caller, empty if entry not used
+  uint32_t cluster;                 ///< First cluster of the directory
+  uint32_t lastUsed;                ///< Access stamp used for LRU replacement
+} FAT_PathCacheEntry;
+/**
+ * @brief Directory name index
+ *
+ * @details Open addressed hash table of the short entries of one
+ * directory, keyed on a hash of the 8.3 name. It's updated when files
+ * are created and deleted, so a search reads only the sectors holding
+ * entries with the same hash - usually one sector, or none if the
+ * file doesn't exist. A directory with more than 3/4 of
+ * FAT_DIR_INDEX_SLOTS short entries isn't indexed and is searched
+ * entry by entry.
+ */
+typedef struct {
+  FAT_DirIndexSlot slots[FAT_DIR_INDEX_SLOTS];
+  uint32_t cluster;   ///< First cluster of the indexed directory, 0 if not used
+  uint8_t valid;      ///< 0 - directory has too many entries, it's searched linearly
+  uint32_t used;      ///< Slots holding entries or removed entries
+  uint32_t freeSlot;  ///< Entries of the directory before this one are all in use
+  uint32_t lastUsed;  ///< Access stamp used for LRU replacement
+} FAT_DirIndex;
+/**
+ * @brief Opened directory
+ *
+ * @details Entries are read into the buffer up to FAT_DIR_READ_SECTORS
+ * sectors of one cluster at a time, with one card transaction.
+ */
+typedef struct {
+  uint32_t first;   ///< First cluster of the directory, 0 if not used
+  uint8_t volume;   ///< ID of the volume holding the directory
+  uint32_t cluster; ///< Cluster being read, 0 after the last entry
+  uint32_t sector;  ///< Sector in the cluster following the buffered ones
+  uint32_t bufSector; ///< First sector held in the buffer
+  uint32_t count;   ///< Entries held in the buffer
+  uint32_t next;    ///< Next entry of the buffer to return
+  uint32_t slots;   ///< Entries read so far
+  uint32_t buf[FAT_DIR_READ_SECTORS * 128]; ///< Directory sectors as 32-bit words
+} FAT_Dir;
+
+/**
+ * @brief FAT cache line
+ *
+ * @details A line holds the requested FAT sector and the sectors
+ * following it, read with one multi-sector transfer. Lines never
+ * overlap, so every FAT sector is cached at most once. Modified
+ * sectors are written to the first FAT when the line is replaced
+ * or the cache is flushed, and to the other copies on sync.
+ */
+typedef struct {
+  uint32_t sector;    ///< First FAT sector held in the line, UINT32_MAX if line is empty
+  uint32_t count;     ///< Number of sectors held in the line
+  uint32_t lastUsed;  ///< Access stamp used for LRU replacement
+  uint32_t dirty;     ///< Bit i set - sector i of the line was modified
+  uint32_t buf[FAT_FAT_CACHE_PREFETCH*128]; ///< FAT sectors as 32-bit entries
+} FAT_FATCacheLine;
+
+/**
+ * @brief Mounted volume
+ *
+ * @details Everything that belongs to one FAT partition: its geometry,
+ * the card it's on and all caches of its sectors. Functions work on
+ * the volume selected by vol, which public functions set from the
+ * file, directory or path they are given.
+ */
+typedef struct {
+  uint8_t mounted;                ///< 1 - volume is mounted
+  FAT_PhysicalCb phyCallbacks;    ///< Physical layer callbacks of the card
+  FAT_PartitionInfo part;         ///< Geometry of the partition
+  /**
+   * @brief Sector cache
+   *
+   * @details The first FAT_CACHE_SECTORS entries are shared by all files
+   * and replaced in LRU order. The remaining FAT_FILE_BUFFERS entries are
+   * private file buffers, which are searched like the shared entries
+   * but only replaced by the file owning them. This way every sector is
+   * held by at most one entry.
+   */
+  FAT_CacheEntry sectorCache[FAT_CACHE_ENTRIES];
+  uint8_t fileBufferUsed[FAT_FILE_BUFFERS]; ///< Which private file buffers are used
+  uint32_t cacheStamp;            ///< Access counter for LRU replacement
+  uint32_t cacheHits;             ///< Number of sector reads served from cache
+  uint32_t cacheMisses;           ///< Number of sector reads that went to the card
+  FAT_FATCacheLine fatCache[FAT_FAT_CACHE_LINES]; ///< Cache for FAT sectors
+  FAT_FATCacheLine* fatCacheLast; ///< Most recently used FAT cache line
+  uint32_t fatCacheHits;          ///< Number of FAT sector reads served from FAT cache
+  uint32_t fatCacheMisses;        ///< Number of FAT cache line loads
+  uint32_t dirtyCount;            ///< Number of dirty cache entries and FAT cache lines
+  uint32_t dirtySince;            ///< Time when the oldest dirty entry was modified
+  uint32_t dirtyBytes;            ///< Bytes written to files since last flush
+  /**
+   * @brief Free cluster bitmap
+   *
+   * @details The FAT is split into segments of FAT_FREE_MAP_CLUSTERS
+   * clusters. Only one segment is kept as a bitmap (bit set - cluster
+   * is free), it's built from the FAT when the allocator first needs
+   * it. The summary has one bit per segment, which is set when the
+   * segment is known to have no free clusters, so full segments are
+   * skipped without reading the FAT.
+   */
+  uint32_t freeMap[FAT_FREE_MAP_CLUSTERS / 32];
+  uint32_t freeMapSegment;        ///< Segment held in the bitmap, UINT32_MAX if none
+  uint32_t freeMapFull[(FAT_FREE_SEGMENTS + 31) / 32]; ///< Summary of full segments
+  /**
+   * @brief FAT sectors written to the first FAT only.
+   *
+   * @details Bit i covers mirrorSectors FAT sectors starting at
+   * sector i*mirrorSectors of the FAT. They are copied to the other FATs
+   * by FAT_Sync.
+   */
+  uint32_t fatMirrorMap[FAT_MIRROR_MAP_BITS / 32];
+  FAT_Journal journal;            ///< Open transaction
+  uint32_t journalSector;         ///< Sector of the journal on the card, 0 if journaling is off
+  uint8_t journalDirty;           ///< Transaction changed since the journal was written
+  FAT_DirIndex dirIndexes[FAT_DIR_INDEXES]; ///< Name indexes of recently searched directories
+  uint32_t dirIndexStamp;         ///< Access counter for LRU replacement of name indexes
+  FAT_PathCacheEntry pathCache[FAT_PATH_CACHE_ENTRIES]; ///< Recently resolved directories
+  uint32_t pathCacheStamp;        ///< Access counter for LRU replacement of path cache entries
+} FAT_Volume;
 
 /**
  * @brief Opened files
@@ -259,770 +597,4381 @@ typedef struct {
  * To delete a file, just write -1 to its ID field.
  */
 static FAT_File openedFiles[MAX_OPENED_FILES];
-static FAT_DiskInfo mountedDisks[FAT_MAX_DISKS]; ///< Disk info for mounted disks
-static uint8_t buf[512]; ///< Buffer for reading sectors
-static FAT_PhysicalCb phyCallbacks; ///< Physical layer callbacks
-
+static FAT_Volume volumes[FAT_MAX_VOLUMES]; ///< Mounted volumes
+static FAT_Volume* vol = volumes;           ///< Volume functions work on
+static uint32_t (*timeCallback)(void); ///< Current date and time for directory entries, 0 if not set
+static uint32_t clusterMapPool[FAT_CLUSTER_MAP_POOL][FAT_CLUSTER_MAP_WORDS]; ///< Cluster map tables
+static uint8_t clusterMapPoolUsed[FAT_CLUSTER_MAP_POOL]; ///< Which cluster map tables are used
+static uint32_t mountOptions; ///< Options set with FAT_SetMountOptions
+static FAT_Ring rings[FAT_MAX_RINGS]; ///< Opened ring files
+static FAT_Dir dirs[FAT_MAX_DIRS]; ///< Opened directories
+
+static int FAT_MountVolume(void (*phyInit)(void),
+    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t partition);
+static const char* FAT_PathVolume(const char* path);
+static FAT_CacheEntry* FAT_CacheFind(uint32_t sector);
+static uint32_t* FAT_ReadFATSector(uint32_t sector);
 static uint32_t FAT_Cluster2Sector(uint32_t cluster);
-//static void FAT_ListRootDir(void);
 static uint32_t FAT_GetEntryInFAT(uint32_t cluster);
-static int FAT_FindFile(FAT_File* file);
+static void FAT_SetEntryInFAT(uint32_t cluster, uint32_t value);
+static int FAT_FindFile(FAT_File* file, uint32_t dirCluster);
+static int FAT_ResolvePath(const char* path, uint32_t* dirCluster, char* name);
+static int FAT_FindLongName(uint32_t dirCluster, const char* longName,
+    uint32_t length, char* name, uint32_t* sector, uint32_t* index);
+static uint32_t FAT_DirSector(FAT_DirWalk* walk, uint32_t slot);
+static uint32_t FAT_DirSlot(uint32_t dirCluster, uint32_t sector, uint32_t index);
 static int FAT_GetNextId(void);
 static int FAT_GetCluster(uint32_t firstCluster, uint32_t clusterOffset,
     uint32_t* clusterNumber);
 static void FAT_UpdateRootEntry(int file);
+static void FAT_MarkEntryDirty(int file, uint32_t bytes);
+static void FAT_ExtentSeek(FAT_Extent* ext, FAT_File* file, uint32_t ptr);
+static uint32_t FAT_ExtentGet(FAT_Extent* ext, uint32_t maxSectors,
+    uint32_t* sector);
+static void FAT_ExtentAdvance(FAT_Extent* ext, uint32_t sectors);
+static void FAT_FreeMapLoad(uint32_t segment);
+static void FAT_FreeMapUpdate(uint32_t cluster, uint8_t isFree);
+static int FAT_ExtendFile(FAT_File* file, FAT_Extent* ext, uint32_t sectors);
+static void FAT_ExtentSetContiguous(FAT_File* file);
+static uint32_t FAT_FindFreeRun(uint32_t start, uint32_t count);
+static void FAT_LinkRun(uint32_t first, uint32_t count);
+static void FAT_MapAppend(FAT_File* file, uint32_t cluster);
+static void FAT_FreeChain(uint32_t cluster);
+static int FAT_FindFreeSlot(uint32_t dirCluster, uint32_t* sector,
+    uint32_t* index);
+static void FAT_SyncVolume(void);
+static int FAT_JournalOpen(void);
+static void FAT_JournalSave(void);
+static FAT_JournalFile* FAT_JournalBegin(FAT_File* file);
+static void FAT_JournalReserve(FAT_File* file);
+static int FAT_JournalFull(FAT_File* file);
+static void FAT_JournalAddRun(FAT_File* file, uint32_t first, uint32_t count,
+    uint32_t prevCluster);
+static void FAT_RingAccess(FAT_Ring* ring, uint32_t offset, uint8_t* data,
+    uint32_t count, uint8_t write);
+static void FAT_RingSaveHeader(FAT_Ring* ring);
+static void FAT_RingFormat(FAT_Ring* ring);
+static FAT_DirIndex* FAT_DirIndexGet(uint32_t cluster);
+static int FAT_DirIndexAdd(FAT_DirIndex* dirIndex, const char* name,
+    uint32_t sector, uint32_t index);
+static void FAT_DirIndexRemove(FAT_DirIndex* dirIndex, const char* name,
+    uint32_t sector, uint32_t index);
+static int FAT_DirFill(FAT_Dir* dir);
+
+/**
+ * @brief Empties the sector cache.
+ */
+static void FAT_CacheInit(void) {
 
+  for (int i = 0; i < FAT_CACHE_ENTRIES; i++) {
+    vol->sectorCache[i].sector = UINT32_MAX;
+    vol->sectorCache[i].lastUsed = 0;
+    vol->sectorCache[i].dirty = 0;
+  }
+  for (int i = 0; i < FAT_FAT_CACHE_LINES; i++) {
+    vol->fatCache[i].sector = UINT32_MAX;
+    vol->fatCache[i].count = 0;
+    vol->fatCache[i].lastUsed = 0;
+    vol->fatCache[i].dirty = 0;
+  }
+  for (int i = 0; i < FAT_FILE_BUFFERS; i++) {
+    vol->fileBufferUsed[i] = 0;
+  }
+  for (int i = 0; i < (FAT_FREE_SEGMENTS + 31) / 32; i++) {
+    vol->freeMapFull[i] = 0;
+  }
+  for (int i = 0; i < FAT_MIRROR_MAP_BITS / 32; i++) {
+    vol->fatMirrorMap[i] = 0;
+  }
+  vol->freeMapSegment = UINT32_MAX;
+  vol->fatCacheLast = &vol->fatCache[0];
+  vol->cacheStamp = 0;
+  vol->cacheHits = 0;
+  vol->cacheMisses = 0;
+  vol->fatCacheHits = 0;
+  vol->fatCacheMisses = 0;
+  vol->dirtyCount = 0;
+  vol->dirtyBytes = 0;
+}
 /**
- * @brief Convenience function for reading sectors.
+ * @brief Writes a dirty cache entry to the card.
  *
- * @details It checks if the sector isn't in the buffer first
- * as a simple caching mechanism.
+ * @details Dirty entries holding the sectors just before and after
+ * it are written along with it, so a run of sectors filled by
+ * small writes reaches the card as one multi-sector transfer.
+ * Without a gather write callback the run is written sector
+ * by sector.
  *
- * @param sector Sector to read.
+ * When the entry is written because it is being replaced, the
+ * last sector of the run is left dirty - it usually is the sector
+ * a file is still appending to, which would be written again.
+ *
+ * @param entry Cache entry
+ * @param evict 1 - entry is about to be replaced, 0 - flush
  */
-static void FAT_ReadSector(uint32_t sector) {
+static void FAT_CacheWriteBack(FAT_CacheEntry* entry, uint8_t evict) {
 
-  static uint32_t sectInBuffer = UINT32_MAX;
-
-  // check if we already read the sector
-  if (sectInBuffer == sector) {
-    println("ReadSector: Sector already read");
+  if (!entry->dirty) {
     return;
   }
 
-  sectInBuffer = sector;
-  phyCallbacks.phyReadSectors(buf, sector, 1);
-  println("ReadSector: Read sector %u", (unsigned int) sector);
+  FAT_JournalSave();
+
+  FAT_CacheEntry* run[FAT_CACHE_ENTRIES];
+  uint32_t first = entry->sector;
+  uint32_t count = 1;
+  FAT_CacheEntry* next;
+
+  // walk back to the first dirty sector of the run
+  while (count < FAT_MAX_TRANSFER && (next = FAT_CacheFind(first - 1)) &&
+      next->dirty) {
+    first--;
+    count++;
+  }
+  count = 0;
+  next = FAT_CacheFind(first);
+  do {
+    run[count++] = next;
+  } while (count < FAT_CACHE_ENTRIES && count < FAT_MAX_TRANSFER &&
+      (next = FAT_CacheFind(first + count)) && next->dirty);
+
+  if (evict && run[count - 1] != entry) {
+    count--;
+  }
+
+  if (vol->phyCallbacks.phyWriteSectorsV) {
+    uint8_t* bufs[FAT_CACHE_ENTRIES];
+    for (uint32_t i = 0; i < count; i++) {
+      bufs[i] = run[i]->buf;
+    }
+    vol->phyCallbacks.phyWriteSectorsV(bufs, first, count);
+  } else {
+    for (uint32_t i = 0; i < count; i++) {
+      vol->phyCallbacks.phyWriteSectors(run[i]->buf, first + i, 1);
+    }
+  }
 
+  for (uint32_t i = 0; i < count; i++) {
+    run[i]->dirty = 0;
+  }
+  vol->dirtyCount -= count;
+  LOG_TRACE("WriteBack: Written %u sectors from %u",
+      (unsigned int) count, (unsigned int) first);
 }
 /**
- * @brief Convenience function for reading sectors.
+ * @brief Writes modified sectors of a FAT cache line to the card.
  *
- * @details It checks if the sector isn't in the buffer first
- * as a simple caching mechanism.
+ * @details Adjacent modified sectors are written with one transfer
+ * per FAT copy. Unless mirror is set, only the first FAT is written and
+ * the sectors are remembered in the mirror map, so that all copies
+ * are brought up to date at once by FAT_Sync.
  *
- * @param sector Sector to read.
+ * @param line FAT cache line
+ * @param mirror 1 - write all FAT copies, 0 - write the first FAT only
  */
-static void FAT_WriteSector(uint32_t sector) {
+static void FAT_FATCacheWriteBack(FAT_FATCacheLine* line, uint8_t mirror) {
+
+  if (!line->dirty) {
+    return;
+  }
+
+  FAT_JournalSave();
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t copies = (mirror && part->mirrored) ? part->numberOfFATs : 1;
 
-  phyCallbacks.phyWriteSectors(buf, sector, 1);
-  println("WriteSector: Written sector %u", (unsigned int) sector);
+  uint32_t i = 0;
+  while (i < line->count) {
+    if (!(line->dirty & (1u << i))) {
+      i++;
+      continue;
+    }
+    uint32_t count = 1;
+    while (i + count < line->count && (line->dirty & (1u << (i + count)))) {
+      count++;
+    }
+    for (uint32_t fat = 0; fat < copies; fat++) {
+      vol->phyCallbacks.phyWriteSectors((uint8_t*)(line->buf + i*128),
+          line->sector + i + fat*part->sectorsPerFAT, count);
+    }
+    if (copies == 1 && part->mirrored) {
+      uint32_t offset = line->sector + i - part->startFatSector;
+      uint32_t last = (offset + count - 1) / part->mirrorSectors;
+      for (uint32_t bit = offset / part->mirrorSectors; bit <= last; bit++) {
+        vol->fatMirrorMap[bit / 32] |= 1u << (bit % 32);
+      }
+    }
+    LOG_TRACE("FATWriteBack: Written %u FAT sectors from %u to %u FATs",
+        (unsigned int) count, (unsigned int) (line->sector + i),
+        (unsigned int) copies);
+    i += count;
+  }
 
+  line->dirty = 0;
+  vol->dirtyCount--;
 }
 /**
- * @brief Initialize FAT file system
- * @param phyInit Physical drive initialization function
- * @param phyReadSectors Read sectors function
- * @param phyWriteSectors Write sectors function
- * @return
+ * @brief Brings all FAT copies up to date with the first FAT.
+ *
+ * @details Modified lines still in the FAT cache are written to all
+ * copies straight from the cache. Sectors written earlier to the first
+ * FAT only are read back (usually from the FAT cache) and copied.
  */
-int8_t FAT_Init(void (*phyInit)(void),
-    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
-    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count)) {
-
-  phyCallbacks.phyInit = phyInit;
-  phyCallbacks.phyReadSectors = phyReadSectors;
-  phyCallbacks.phyWriteSectors = phyWriteSectors;
+static void FAT_FATMirror(void) {
 
-  // initialize physical layer
-  phyCallbacks.phyInit();
+  FAT_PartitionInfo* part = &vol->part;
 
-  // Read MBR - first sector (0)
-  FAT_ReadSector(0);
+  for (int i = 0; i < FAT_FAT_CACHE_LINES; i++) {
+    FAT_FATCacheWriteBack(&vol->fatCache[i], 1);
+  }
 
-  FAT_MBR* mbr = (FAT_MBR*)buf;
-  if (mbr->signature != 0xaa55) {
-    println("Invalid disk signature %04x", mbr->signature);
-    return -1;
+  if (!part->mirrored) {
+    return;
   }
-  println("Found valid disk signature");
 
-  // dump partition table
-//  hexdump((uint8_t*)mbr->partitionTable, sizeof(FAT_PartitionTableEntry)*4);
+  uint32_t fatEnd = part->startFatSector + part->sectorsPerFAT;
 
-  // TODO Extend to more than one disk
-  mountedDisks[0].diskID = 0;
+  for (uint32_t bit = 0; bit < FAT_MIRROR_MAP_BITS; bit++) {
+    if (!(vol->fatMirrorMap[bit / 32] & (1u << (bit % 32)))) {
+      continue;
+    }
+    vol->fatMirrorMap[bit / 32] &= ~(1u << (bit % 32));
 
-  // 4 partition table entries
-  for (int i = 0; i < 4; i++) {
-    if (mbr->partitionTable[i].type == 0 ) {
-      println("Found empty partition");
-    } else {
-      println("Partition %d type is: %02x", i, mbr->partitionTable[i].type);
-      if (mbr->partitionTable[i].type == PAR_TYPE_FAT32) {
-        println("FAT32 partition found");
+    uint32_t sector = part->startFatSector + bit * part->mirrorSectors;
+    uint32_t end = sector + part->mirrorSectors;
+    if (end > fatEnd) {
+      end = fatEnd;
+    }
+    while (sector < end) {
+      uint32_t* buf = FAT_ReadFATSector(sector);
+      uint32_t count = vol->fatCacheLast->sector + vol->fatCacheLast->count - sector;
+      if (count > end - sector) {
+        count = end - sector;
       }
-      println("Partition %d start sector is: %u", i, (unsigned int)mbr->partitionTable[i].partitionLBA);
-      println("Partition %d size is: %u", i, (unsigned int)mbr->partitionTable[i].size*512);
-
-      mountedDisks[0].partitionInfo[i].partitionNumber = i;
-      mountedDisks[0].partitionInfo[i].type = mbr->partitionTable[i].type;
-      mountedDisks[0].partitionInfo[i].startAddress = mbr->partitionTable[i].partitionLBA;
-      mountedDisks[0].partitionInfo[i].length = mbr->partitionTable[i].size;
+      for (uint32_t fat = 1; fat < part->numberOfFATs; fat++) {
+        vol->phyCallbacks.phyWriteSectors((uint8_t*)buf,
+            sector + fat*part->sectorsPerFAT, count);
+      }
+      LOG_TRACE("FATMirror: Copied %u FAT sectors from %u",
+          (unsigned int) count, (unsigned int) sector);
+      sector += count;
     }
   }
+}
+/**
+ * @brief Marks a sector of a FAT cache line as modified.
+ * @param line FAT cache line
+ * @param sector FAT sector held in the line
+ */
+static void FAT_FATCacheMarkDirty(FAT_FATCacheLine* line, uint32_t sector) {
 
-  // Read boot sector of first partition
-  FAT_ReadSector(mountedDisks[0].partitionInfo[0].startAddress);
-
-  FAT32_BootSector* bootSector = (FAT32_BootSector*)buf;
-
-  if (bootSector->signature != 0xaa55) {
-    println("Invalid partition signature %04x", mbr->signature);
-    return -2;
+  if (!line->dirty) {
+    if (!vol->dirtyCount) {
+      vol->dirtySince = TIMER_GetTime();
+    }
+    vol->dirtyCount++;
   }
+  line->dirty |= 1u << (sector - line->sector);
+}
+/**
+ * @brief Writes all dirty sectors in the cache to the card.
+ *
+ * @details The FAT goes first, so that a directory entry written
+ * to the card never points at clusters which are still free there.
+ * Only the first FAT is written, the other copies are updated by
+ * FAT_Sync.
+ */
+static void FAT_CacheFlush(void) {
 
-  println("Found valid partition signature");
-
-  // We already have length from partition table, so just display
-//  println("Partition size is %d", (unsigned int)bootSector->totalSectors32);
-
-  if (bootSector->totalSectors32 != mountedDisks[0].partitionInfo[0].length) {
-    println("Error: Wrong partition size");
-    while(1);
+  for (int i = 0; i < FAT_FAT_CACHE_LINES && vol->dirtyCount; i++) {
+    FAT_FATCacheWriteBack(&vol->fatCache[i], 0);
   }
-  // reserved sectors are the sectors before the FAT including boot sector
-//  println("Reserved sectors = %d", (unsigned int)bootSector->reservedSectors);
+  for (int i = 0; i < FAT_CACHE_ENTRIES && vol->dirtyCount; i++) {
+    FAT_CacheWriteBack(&vol->sectorCache[i], 0);
+  }
+  vol->dirtyBytes = 0;
+}
+/**
+ * @brief Flushes the cache if one of the write-back thresholds is exceeded.
+ *
+ * @details Bounds the amount of data lost on power failure when
+ * the application doesn't sync files often enough.
+ */
+static void FAT_CacheCheckFlush(void) {
 
-//  println("Bytes per sector %d", (unsigned int)bootSector->bytesPerSector);
+  FAT_Volume* current = vol;
 
-  if (bootSector->bytesPerSector != 512) {
-    // TODO Make library sector length independent
-    println("Error: incompatible sector length");
-    while(1);
+  // other volumes may be idle, their sectors age as well
+  for (vol = volumes; vol < volumes + FAT_MAX_VOLUMES; vol++) {
+    if (!vol->mounted || !vol->dirtyCount) {
+      continue;
+    }
+#if FAT_FLUSH_BYTES
+    if (vol->dirtyBytes >= FAT_FLUSH_BYTES) {
+      LOG_TRACE("CheckFlush: Byte threshold reached");
+      FAT_CacheFlush();
+      continue;
+    }
+#endif
+#if FAT_FLUSH_AGE_MS
+    if (TIMER_GetTime() - vol->dirtySince >= FAT_FLUSH_AGE_MS) {
+      LOG_TRACE("CheckFlush: Age threshold reached");
+      FAT_CacheFlush();
+    }
+#endif
   }
-  // hidden sectors are the sectors on disk preceding partition
-//  println("Hidden sectors %d", (unsigned int)bootSector->hiddenSectors);
-  println("Sectors per cluster =  %d", (unsigned int)bootSector->sectorsPerCluster);
-  println("Number of FATs =  %d", (unsigned int)bootSector->numberOfFATs);
-  println("Sectors per FAT =  %d", (unsigned int)bootSector->sectorsPerFAT32);
-
-  // The cluster where the root directory is at
-  println("Root cluster = %d", (unsigned int)bootSector->rootCluster);
-//  println("FSInfo structure is at sector %d", (unsigned int)bootSector->fsInfo);
-//  println("Backup boot sector is at sector %d", (unsigned int)bootSector->backupBootSector);
+  vol = current;
+}
+/**
+ * @brief Finds a cached sector.
+ * @param sector Sector to find
+ * @return Cache entry holding the sector or 0 if sector isn't cached.
+ */
+static FAT_CacheEntry* FAT_CacheFind(uint32_t sector) {
 
+  for (int i = 0; i < FAT_CACHE_ENTRIES; i++) {
+    if (vol->sectorCache[i].sector == sector) {
+      return &vol->sectorCache[i];
+    }
+  }
+  return 0;
+}
+/**
+ * @brief Gets a sector through the sector cache.
+ *
+ * @details If the sector is not cached, the least recently
+ * used entry is replaced with it. A sector about to be overwritten
+ * doesn't have to be read - it's zero filled instead, also when it's
+ * cached, so stale data of released clusters isn't written back.
+ *
+ * @param sector Sector to get.
+ * @param load 1 - read sector from card on a miss, 0 - zero fill it
+ * @return Pointer to the sector data. It stays valid until
+ * the next call to FAT_GetSector.
+ */
+static uint8_t* FAT_GetSector(uint32_t sector, uint8_t load) {
 
-  // Sector on disk where FAT is (from start of disk)
-  uint32_t fatStart = mountedDisks[0].partitionInfo[0].startAddress +
-      bootSector->reservedSectors;
+  FAT_CacheEntry* entry = FAT_CacheFind(sector);
 
-  mountedDisks[0].partitionInfo[0].startFatSector = fatStart;
-  println("FATs start at sector %d", (unsigned int)fatStart);
+  // check if we already read the sector
+  if (entry) {
+    vol->cacheHits++;
+    entry->lastUsed = ++vol->cacheStamp;
+    LOG_TRACE("ReadSector: Sector %u in cache", (unsigned int) sector);
+    if (!load) {
+      memset(entry->buf, 0, 512);
+    }
+    return entry->buf;
+  }
 
-  // Sector on disk where data clusters start
-  // Cluster count start from 2
-  // So this sector is where cluster 2 is allocated on disk
-  uint32_t clusterStart = fatStart + bootSector->numberOfFATs *
-      bootSector->sectorsPerFAT32;
+  // find least recently used entry (empty entries have lastUsed == 0)
+  entry = &vol->sectorCache[0];
+  for (int i = 1; i < FAT_CACHE_SECTORS; i++) {
+    if (vol->sectorCache[i].lastUsed < entry->lastUsed) {
+      entry = &vol->sectorCache[i];
+    }
+  }
 
-  mountedDisks[0].partitionInfo[0].dataStartSector = clusterStart;
+  // dirty sector has to be saved before being replaced
+  FAT_CacheWriteBack(entry, 1);
+
+  entry->sector = sector;
+  entry->lastUsed = ++vol->cacheStamp;
+  if (load) {
+    vol->cacheMisses++;
+    vol->phyCallbacks.phyReadSectors(entry->buf, sector, 1);
+    LOG_TRACE("ReadSector: Read sector %u", (unsigned int) sector);
+  } else {
+    memset(entry->buf, 0, 512);
+  }
 
-  uint32_t sectorsPerCluster = bootSector->sectorsPerCluster;
+  return entry->buf;
+}
+/**
+ * @brief Reads a sector through the sector cache.
+ * @param sector Sector to read.
+ * @return Pointer to the sector data. It stays valid until
+ * the next call to FAT_ReadSector.
+ */
+static uint8_t* FAT_ReadSector(uint32_t sector) {
 
-  // needed for mapping clusters to sectors
-  mountedDisks[0].partitionInfo[0].sectorsPerCluster = sectorsPerCluster;
+  return FAT_GetSector(sector, 1);
+}
+/**
+ * @brief Finds a cached FAT sector.
+ * @param sector FAT sector to find
+ * @return FAT cache line holding the sector or 0 if sector isn't cached.
+ */
+static FAT_FATCacheLine* FAT_FATCacheFind(uint32_t sector) {
 
-  mountedDisks[0].partitionInfo[0].bytesPerSector = bootSector->bytesPerSector;
+  for (int i = 0; i < FAT_FAT_CACHE_LINES; i++) {
+    if (sector - vol->fatCache[i].sector < vol->fatCache[i].count) {
+      return &vol->fatCache[i];
+    }
+  }
+  return 0;
+}
+/**
+ * @brief Reads a FAT sector through the FAT cache.
+ *
+ * @details On a miss the requested sector and up to
+ * FAT_FAT_CACHE_PREFETCH-1 following sectors of the FAT are read
+ * into the least recently used line with a single transfer, so a
+ * sequential walk of a cluster chain goes to the card once per
+ * FAT_FAT_CACHE_PREFETCH*128 entries.
+ *
+ * @param sector FAT sector to read.
+ * @return Pointer to the 128 entries of the sector. It stays valid
+ * until the next call to FAT_ReadFATSector.
+ */
+static uint32_t* FAT_ReadFATSector(uint32_t sector) {
 
-  uint32_t rootCluster = bootSector->rootCluster;
+  FAT_FATCacheLine* line = vol->fatCacheLast;
 
-  mountedDisks[0].partitionInfo[0].rootDirSector = FAT_Cluster2Sector(rootCluster);
-  mountedDisks[0].partitionInfo[0].rootDirCluster = bootSector->rootCluster;
+  // check if sector is in the last used line first
+  if (sector - line->sector >= line->count) {
+    line = FAT_FATCacheFind(sector);
+  }
 
-//  FAT_ListRootDir();
+  if (line) {
+    vol->fatCacheHits++;
+    line->lastUsed = ++vol->cacheStamp;
+    vol->fatCacheLast = line;
+    return line->buf + (sector - line->sector) * 128;
+  }
 
-  // Set all IDs to free slot
-  for (int i = 0; i < MAX_OPENED_FILES; i++) {
-    openedFiles[i].id = -1;
+  // find least recently used line (empty lines have lastUsed == 0)
+  line = &vol->fatCache[0];
+  for (int i = 1; i < FAT_FAT_CACHE_LINES; i++) {
+    if (vol->fatCache[i].lastUsed < line->lastUsed) {
+      line = &vol->fatCache[i];
+    }
+  }
+  FAT_FATCacheWriteBack(line, 0);
+  line->sector = UINT32_MAX;
+  line->count = 0;
+
+  // prefetch following sectors up to the end of the FAT
+  // or the next sector held by another line
+  uint32_t fatEnd = vol->part.startFatSector +
+      vol->part.sectorsPerFAT;
+  uint32_t count = 1;
+  while (count < FAT_FAT_CACHE_PREFETCH && sector + count < fatEnd &&
+      !FAT_FATCacheFind(sector + count)) {
+    count++;
   }
 
-  return 0;
+  vol->fatCacheMisses++;
+  vol->phyCallbacks.phyReadSectors((uint8_t*)line->buf, sector, count);
+  line->sector = sector;
+  line->count = count;
+  line->lastUsed = ++vol->cacheStamp;
+  vol->fatCacheLast = line;
+  LOG_TRACE("ReadFATSector: Read %u FAT sectors from %u",
+      (unsigned int) count, (unsigned int) sector);
+
+  return line->buf;
 }
 /**
- * @brief Opens a file.
- * @param filename Name of file
- * @return ID of file
+ * @brief Gets a data sector of a file.
+ *
+ * @details Files owning a private buffer keep their working sector
+ * there, so other files can't evict it. Other files use the shared
+ * cache. A sector cached in another entry is moved to the private
+ * buffer together with its dirty state.
  *
- * TODO Add parsing paths.
- * TODO Add long filenames
+ * @param file File
+ * @param sector Sector to get
+ * @param load 1 - read sector from card if not cached, 0 - zero fill it
+ * (cached or not)
+ * @return Pointer to the sector data.
  */
-int FAT_OpenFile(const char* filename) {
+static uint8_t* FAT_GetFileSector(FAT_File* file, uint32_t sector,
+    uint8_t load) {
 
-  FAT_File file;
-  strcpy(file.filename, filename);
-  println("%s: Opening file %s", __FUNCTION__, filename);
+  FAT_CacheEntry* entry = file->buffer;
 
-  int id = FAT_FindFile(&file);
+  if (!entry) {
+    return FAT_GetSector(sector, load);
+  }
 
-  if (id != -1) {
-    // copy file information structure
-    openedFiles[id] = file;
+  if (entry->sector == sector) {
+    vol->cacheHits++;
+    if (!load) {
+      memset(entry->buf, 0, 512);
+    }
+    return entry->buf;
   }
 
-  return id;
-}
-/**
- * @brief Create new file
- * @param filename name of new file
- * @return File ID or -1 if file exists
- * TODO Finish this function
- */
-int FAT_NewFile(const char* filename) {
-  FAT_File file;
-  strcpy(file.filename, filename);
-  println("%s: Opening file %s", __FUNCTION__, filename);
+  // save previous sector
+  FAT_CacheWriteBack(entry, 1);
 
-  int id = FAT_FindFile(&file);
+  FAT_CacheEntry* cached = FAT_CacheFind(sector);
 
-  // if file found
-  if (id != -1) {
-    // file already exists
-    return -1;
+  if (cached) {
+    // take over the cached copy
+    vol->cacheHits++;
+    if (load) {
+      memcpy(entry->buf, cached->buf, 512);
+    } else {
+      memset(entry->buf, 0, 512);
+    }
+    entry->dirty = cached->dirty;
+    cached->sector = UINT32_MAX;
+    cached->lastUsed = 0;
+    cached->dirty = 0;
+  } else if (load) {
+    vol->cacheMisses++;
+    vol->phyCallbacks.phyReadSectors(entry->buf, sector, 1);
+    LOG_TRACE("ReadFileSector: Read sector %u", (unsigned int) sector);
+  } else {
+    memset(entry->buf, 0, 512);
   }
-  return 0;
+  entry->sector = sector;
+
+  return entry->buf;
 }
 /**
- * @brief Close a file.
+ * @brief Attaches a private sector buffer to a file.
+ *
+ * @details The buffer is taken from a pool of FAT_FILE_BUFFERS
+ * buffers and returned when the file is closed. Files accessed
+ * alternately keep their working sector resident this way.
+ *
  * @param file ID of file
- * @return ID of closed file (won't be useful anymore) or -1 if error.
+ * @retval 0 Buffer attached
+ * @retval -1 Error: file not opened or no free buffer
  */
-int FAT_CloseFile(int file) {
+int FAT_AttachFileBuffer(int file) {
 
   // if incorrect file ID
-  if (file >= MAX_OPENED_FILES) {
+  if (file < 0 || file >= MAX_OPENED_FILES) {
     return -1;
   }
   // File not opened
   if (openedFiles[file].id == -1) {
-    return -1; // EOF for not open file
+    return -1;
   }
-  // close file if no errors
-  openedFiles[file].id = -1;
-  return file;
+  vol = &volumes[openedFiles[file].volume];
+  // already has a buffer
+  if (openedFiles[file].buffer) {
+    return 0;
+  }
+
+  for (int i = 0; i < FAT_FILE_BUFFERS; i++) {
+    if (!vol->fileBufferUsed[i]) {
+      vol->fileBufferUsed[i] = 1;
+      openedFiles[file].buffer = &vol->sectorCache[FAT_CACHE_SECTORS + i];
+      openedFiles[file].buffer->sector = UINT32_MAX;
+      return 0;
+    }
+  }
+
+  LOG_WARN("%s: No free file buffer", __FUNCTION__);
+  return -1;
 }
 /**
- * @brief Move the read pointer to new location in file
- * @param file File ID
- * @param newWrPtr New read pointer location
- * @return New read pointer location or -1 if error ocurred.
+ * @brief Writes a cached sector to the card.
+ *
+ * @details The sector has to be read with FAT_ReadSector first
+ * and modified in the returned buffer. In write-back mode the
+ * sector is only marked dirty and is written to the card when
+ * it is evicted from the cache or the cache is flushed.
+ *
+ * @param sector Sector to write.
  */
-int FAT_MoveRdPtr(int file, int newWrPtr) {
+static void FAT_WriteSector(uint32_t sector) {
 
-  // if incorrect file ID
-  if (file >= MAX_OPENED_FILES) {
+  FAT_CacheEntry* entry = FAT_CacheFind(sector);
+
+  if (!entry) {
+    LOG_ERROR("WriteSector: Sector %u not in cache", (unsigned int) sector);
+    return;
+  }
+
+  entry->lastUsed = ++vol->cacheStamp;
+
+#if FAT_WRITE_BACK
+  if (!entry->dirty) {
+    if (!vol->dirtyCount) {
+      vol->dirtySince = TIMER_GetTime();
+    }
+    entry->dirty = 1;
+    vol->dirtyCount++;
+  }
+  LOG_TRACE("WriteSector: Sector %u marked dirty", (unsigned int) sector);
+#else
+  FAT_JournalSave();
+  vol->phyCallbacks.phyWriteSectors(entry->buf, sector, 1);
+  LOG_TRACE("WriteSector: Written sector %u", (unsigned int) sector);
+#endif
+
+}
+/**
+ * @brief Reads sectors directly into a buffer, bypassing the cache.
+ *
+ * @details Dirty cached sectors in the range are newer than
+ * their copies on the card, so they are copied over the data read.
+ *
+ * @param data Buffer for data (count*512 bytes)
+ * @param sector First sector to read
+ * @param count Number of sectors to read
+ */
+static void FAT_ReadSectorsDirect(uint8_t* data, uint32_t sector, uint32_t count) {
+
+  vol->phyCallbacks.phyReadSectors(data, sector, count);
+  LOG_TRACE("ReadSectorsDirect: Read %u sectors from %u",
+      (unsigned int) count, (unsigned int) sector);
+
+  for (int i = 0; i < FAT_CACHE_ENTRIES && vol->dirtyCount; i++) {
+    if (vol->sectorCache[i].dirty && vol->sectorCache[i].sector - sector < count) {
+      memcpy(data + (vol->sectorCache[i].sector - sector) * 512,
+          vol->sectorCache[i].buf, 512);
+    }
+  }
+}
+/**
+ * @brief Writes sectors directly from a buffer, bypassing the cache.
+ *
+ * @details Cached copies of the sectors are dropped as they
+ * are overwritten by the new data.
+ *
+ * @param data Data to write (count*512 bytes)
+ * @param sector First sector to write
+ * @param count Number of sectors to write
+ */
+static void FAT_WriteSectorsDirect(const uint8_t* data, uint32_t sector,
+    uint32_t count) {
+
+  vol->phyCallbacks.phyWriteSectors((uint8_t*)data, sector, count);
+  LOG_TRACE("WriteSectorsDirect: Written %u sectors from %u",
+      (unsigned int) count, (unsigned int) sector);
+
+  for (int i = 0; i < FAT_CACHE_ENTRIES; i++) {
+    if (vol->sectorCache[i].sector - sector < count) {
+      if (vol->sectorCache[i].dirty) {
+        vol->dirtyCount--;
+      }
+      vol->sectorCache[i].sector = UINT32_MAX;
+      vol->sectorCache[i].lastUsed = 0;
+      vol->sectorCache[i].dirty = 0;
+    }
+  }
+}
+/**
+ * @brief Gets sector cache statistics.
+ * @param volume ID of volume
+ * @param hits Number of sector reads served from the cache (function writes this)
+ * @param misses Number of sector reads from the card (function writes this)
+ * @retval 0 Statistics written
+ * @retval -1 Error: volume not mounted
+ */
+int FAT_GetCacheStats(int volume, uint32_t* hits, uint32_t* misses) {
+
+  if (volume < 0 || volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
     return -1;
   }
+  *hits = volumes[volume].cacheHits;
+  *misses = volumes[volume].cacheMisses;
+  return 0;
+}
+/**
+ * @brief Gets FAT cache statistics.
+ * @param volume ID of volume
+ * @param hits Number of FAT sector reads served from the FAT cache (function writes this)
+ * @param misses Number of FAT cache line loads from the card (function writes this)
+ * @retval 0 Statistics written
+ * @retval -1 Error: volume not mounted
+ */
+int FAT_GetFATCacheStats(int volume, uint32_t* hits, uint32_t* misses) {
 
-  // File not opened
-  if (openedFiles[file].id == -1) {
-    return -1; // EOF for not open file
+  if (volume < 0 || volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
+    return -1;
   }
+  *hits = volumes[volume].fatCacheHits;
+  *misses = volumes[volume].fatCacheMisses;
+  return 0;
+}
+/**
+ * @brief Gets free space of the volume.
+ *
+ * @details The count is taken from the FSInfo sector and kept up to
+ * date by the allocator. Only if FSInfo doesn't hold a valid count, the
+ * whole FAT is scanned once.
+ *
+ * @param volume ID of volume
+ * @param freeClusters Number of free clusters (function writes this)
+ * @param clusterSize Size of cluster in bytes (function writes this)
+ * @retval 0 Free space written
+ * @retval -1 Error: volume not mounted
+ */
+int FAT_GetFree(int volume, uint32_t* freeClusters, uint32_t* clusterSize) {
 
-  // Can't move beyond length of file for read
-  if (newWrPtr > openedFiles[file].fileSize) {
-    println("%s: EOF reached", __FUNCTION__);
+  if (volume < 0 || volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
     return -1;
   }
+  vol = &volumes[volume];
+  FAT_PartitionInfo* part = &vol->part;
+
+  if (part->freeClusters == UINT32_MAX) {
+    uint32_t segments = (part->clusterCount + 1) / FAT_FREE_MAP_CLUSTERS + 1;
+    uint32_t count = 0;
+    for (uint32_t segment = 0; segment < segments; segment++) {
+      FAT_FreeMapLoad(segment);
+      uint32_t segmentCount = 0;
+      for (int i = 0; i < FAT_FREE_MAP_CLUSTERS / 32; i++) {
+        segmentCount += __builtin_popcount(vol->freeMap[i]);
+      }
+      if (!segmentCount && segment < FAT_FREE_SEGMENTS) {
+        vol->freeMapFull[segment / 32] |= 1u << (segment % 32);
+      }
+      count += segmentCount;
+    }
+    part->freeClusters = count;
+    part->fsInfoDirty = 1;
+  }
 
-  // if no errors - move the read pointer
-  openedFiles[file].rdPtr = newWrPtr;
-  return newWrPtr;
+  *freeClusters = part->freeClusters;
+  *clusterSize = part->sectorsPerCluster * part->bytesPerSector;
+  return 0;
 }
 /**
- * @brief Move the write pointer to new location in file.
- * @param file File ID
- * @param newWrPtr New write pointer location
- * @return New write pointer location or -1 if error ocurred.
- * FIXME Finish function
+ * @brief Sets the source of modification times of files.
+ * @param getTime Function returning the current time in FAT format:
+ * date in the upper 16 bits, time in the lower 16 bits. If 0,
+ * modification times are left unchanged.
  */
-int FAT_MoveWrPtr(int file, int newWrPtr) {
-  // if incorrect file ID
-  if (file >= MAX_OPENED_FILES) {
+void FAT_SetTimeCallback(uint32_t (*getTime)(void)) {
+
+  timeCallback = getTime;
+}
+/**
+ * @brief Sets the function writing sectors from separate buffers.
+ *
+ * @details With it, runs of consecutive dirty sectors in the sector
+ * cache are written with one multi-sector transfer instead of
+ * one transfer per sector.
+ *
+ * @param volume ID of volume
+ * @param phyWriteSectorsV Write sectors function taking one buffer
+ * per sector, 0 to write cached sectors one at a time.
+ * @retval 0 Function set
+ * @retval -1 Error: volume not mounted
+ */
+int FAT_SetGatherWrite(int volume,
+    uint8_t (*phyWriteSectorsV)(uint8_t* const* bufs, uint32_t sector,
+    uint32_t count)) {
+
+  if (volume < 0 || volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
     return -1;
   }
-  // File not opened
-  if (openedFiles[file].id == -1) {
-    return -1; // EOF for not open file
+  volumes[volume].phyCallbacks.phyWriteSectorsV = phyWriteSectorsV;
+  return 0;
+}
+/**
+ * @brief Sets options used by the following FAT_Init and FAT_Mount.
+ *
+ * @details FAT_OPT_SINGLE_FAT turns off mirroring of the FAT: only the
+ * first FAT is written and the boot sector is changed to mark it as
+ * the only active one. Other copies are left stale, so use it only on
+ * cards the application formats itself. A volume already marked this
+ * way is always mounted with a single FAT.
+ *
+ * FAT_OPT_JOURNAL turns on the append journal (see FAT_JournalOpen).
+ *
+ * @param options Bitwise OR of FAT_OPT_* flags
+ */
+void FAT_SetMountOptions(uint32_t options) {
+
+  mountOptions = options;
+}
+/**
+ * @brief Writes free cluster count and allocation hint to FSInfo.
+ */
+static void FAT_WriteFSInfo(void) {
+
+  FAT_PartitionInfo* part = &vol->part;
+
+  if (!part->fsInfoDirty || !part->fsInfoSector) {
+    return;
   }
-  // TODO If new ptr value is larger than file size - zero pad
-  // Can't move beyond length of file for read
-//  if (newWrPtr > openedFiles[file].fileSize) {
-//    println("EOF reached");
-//    return -1;
-//  }
 
-  openedFiles[file].wrPtr = newWrPtr;
-  return newWrPtr;
+  FAT_FSInfo* fsInfo = (FAT_FSInfo*)FAT_ReadSector(part->fsInfoSector);
+  fsInfo->freeCount = part->freeClusters;
+  fsInfo->nextFree = part->nextFreeCluster;
+  FAT_WriteSector(part->fsInfoSector);
+  part->fsInfoDirty = 0;
 }
 /**
- * @brief Reads contents of file.
- * @param file ID of opened file
- * @param data Buffer for storing data
- * @param count Number of bytes to read
- * @return Number of bytes read or -1 for EOF
- * TODO Also read next clusters
+ * @brief Initialize FAT file system
+ *
+ * @details Closes all files and unmounts all volumes, then mounts
+ * the first partition of the card as volume 0. Other partitions
+ * and cards are mounted with FAT_Mount.
+ *
+ * @param phyInit Physical drive initialization function
+ * @param phyReadSectors Read sectors function
+ * @param phyWriteSectors Write sectors function
+ * @retval 0 Volume 0 mounted
+ * @retval -1 Invalid disk signature
+ * @retval -2 Invalid partition: empty, no boot sector signature or size
+ * not matching the boot sector
+ * @retval -3 Unsupported partition: not FAT32 or sectors other than
+ * 512 bytes
+ * @retval -4 Journaling is requested, but the journal is damaged or
+ * can't be created
+ */
+int8_t FAT_Init(void (*phyInit)(void),
+    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count)) {
+
+  // Set all IDs to free slot
+  for (int i = 0; i < MAX_OPENED_FILES; i++) {
+    openedFiles[i].id = -1;
+  }
+  for (int i = 0; i < FAT_MAX_RINGS; i++) {
+    rings[i].file = -1;
+  }
+  for (int i = 0; i < FAT_MAX_DIRS; i++) {
+    dirs[i].first = 0;
+  }
+  for (int i = 0; i < FAT_MAX_VOLUMES; i++) {
+    volumes[i].mounted = 0;
+  }
+
+  vol = &volumes[0];
+  return FAT_MountVolume(phyInit, phyReadSectors, phyWriteSectors, 0);
+}
+/**
+ * @brief Mounts a partition as a new volume.
+ *
+ * @details Every volume has its own caches, so volumes don't
+ * evict each other's sectors. Paths of files and directories on
+ * volumes other than 0 start with the volume ID and a colon,
+ * e.g. "1:/LOGS/DATA.BIN". Mount options set with
+ * FAT_SetMountOptions apply.
+ *
+ * @param phyInit Physical drive initialization function, 0 if the
+ * card is already initialized (another partition of it is mounted)
+ * @param phyReadSectors Read sectors function
+ * @param phyWriteSectors Write sectors function
+ * @param partition Number of the partition in the MBR (0-3)
+ * @return ID of the volume or -1 if the partition is not valid or
+ * already mounted, too many volumes are mounted or journaling is
+ * requested, but the journal is damaged or can't be created.
+ */
+int FAT_Mount(void (*phyInit)(void),
+    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t partition) {
+
+  int volId = 0;
+  while (volId < FAT_MAX_VOLUMES && volumes[volId].mounted) {
+    volId++;
+  }
+  if (volId == FAT_MAX_VOLUMES || partition > 3) {
+    return -1;
+  }
+
+  vol = &volumes[volId];
+  if (FAT_MountVolume(phyInit, phyReadSectors, phyWriteSectors, partition)) {
+    return -1;
+  }
+  return volId;
+}
+/**
+ * @brief Unmounts a volume.
+ *
+ * @details Metadata and cached sectors are written to the card.
+ *
+ * @param volume ID of volume
+ * @retval 0 Volume unmounted
+ * @retval -1 Error: volume not mounted or files or directories on it
+ * are opened
+ */
+int FAT_Unmount(int volume) {
+
+  if (volume < 0 || volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
+    return -1;
+  }
+  for (int i = 0; i < MAX_OPENED_FILES; i++) {
+    if (openedFiles[i].id != -1 && openedFiles[i].volume == volume) {
+      LOG_INFO("%s: File %s is opened", __FUNCTION__, openedFiles[i].filename);
+      return -1;
+    }
+  }
+  for (int i = 0; i < FAT_MAX_DIRS; i++) {
+    if (dirs[i].first && dirs[i].volume == volume) {
+      return -1;
+    }
+  }
+
+  vol = &volumes[volume];
+  FAT_SyncVolume();
+  vol->mounted = 0;
+  return 0;
+}
+/**
+ * @brief Mounts a partition as the selected volume.
+ * @param phyInit Physical drive initialization function, 0 if not needed
+ * @param phyReadSectors Read sectors function
+ * @param phyWriteSectors Write sectors function
+ * @param partition Number of the partition in the MBR (0-3)
+ * @retval 0 Volume mounted
+ * @retval -1 Invalid disk signature
+ * @retval -2 Invalid partition: empty, already mounted, no boot sector
+ * signature or size not matching the boot sector
+ * @retval -3 Unsupported partition: not FAT32 or sectors other than
+ * 512 bytes
+ * @retval -4 Journaling is requested, but the journal is damaged or
+ * can't be created
+ */
+static int FAT_MountVolume(void (*phyInit)(void),
+    uint8_t (*phyReadSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t (*phyWriteSectors)(uint8_t* buf, uint32_t sector, uint32_t count),
+    uint8_t partition) {
+
+  vol->phyCallbacks.phyInit = phyInit;
+  vol->phyCallbacks.phyReadSectors = phyReadSectors;
+  vol->phyCallbacks.phyWriteSectors = phyWriteSectors;
+  vol->phyCallbacks.phyWriteSectorsV = 0;
+
+  // initialize physical layer
+  if (phyInit) {
+    vol->phyCallbacks.phyInit();
+  }
+
+  FAT_CacheInit();
+
+  // Read MBR - first sector (0)
+  FAT_MBR* mbr = (FAT_MBR*)FAT_ReadSector(0);
+  if (mbr->signature != 0xaa55) {
+    LOG_ERROR("Invalid disk signature %04x", mbr->signature);
+    return -1;
+  }
+  LOG_INFO("Found valid disk signature");
+
+  // dump partition table
+//  hexdump((uint8_t*)mbr->partitionTable, sizeof(FAT_PartitionTableEntry)*4);
+
+  // 4 partition table entries
+  for (int i = 0; i < 4; i++) {
+    if (mbr->partitionTable[i].type == 0 ) {
+      LOG_INFO("Found empty partition");
+    } else {
+      LOG_INFO("Partition %d type is: %02x", i, mbr->partitionTable[i].type);
+      if (mbr->partitionTable[i].type == PAR_TYPE_FAT32 ||
+          mbr->partitionTable[i].type == PAR_TYPE_FAT32_LBA) {
+        LOG_INFO("FAT32 partition found");
+      }
+      LOG_INFO("Partition %d start sector is: %u", i, (unsigned int)mbr->partitionTable[i].partitionLBA);
+      LOG_INFO("Partition %d size is: %u", i, (unsigned int)mbr->partitionTable[i].size*512);
+    }
+  }
+
+  if (mbr->partitionTable[partition].type == 0) {
+    LOG_ERROR("Partition %d is empty", partition);
+    return -2;
+  }
+  if (mbr->partitionTable[partition].type != PAR_TYPE_FAT32 &&
+      mbr->partitionTable[partition].type != PAR_TYPE_FAT32_LBA) {
+    LOG_ERROR("Partition %d isn't FAT32", partition);
+    return -3;
+  }
+  vol->part.partitionNumber = partition;
+  vol->part.type = mbr->partitionTable[partition].type;
+  vol->part.startAddress = mbr->partitionTable[partition].partitionLBA;
+  vol->part.length = mbr->partitionTable[partition].size;
+
+  // a partition mounted twice would have two sets of caches
+  for (int i = 0; i < FAT_MAX_VOLUMES; i++) {
+    if (volumes[i].mounted &&
+        volumes[i].phyCallbacks.phyReadSectors == phyReadSectors &&
+        volumes[i].part.startAddress == vol->part.startAddress) {
+      LOG_ERROR("Partition %d is already mounted as volume %d", partition, i);
+      return -2;
+    }
+  }
+
+  // Read boot sector of the partition
+  FAT32_BootSector* bootSector = (FAT32_BootSector*)
+      FAT_ReadSector(vol->part.startAddress);
+
+  if (bootSector->signature != 0xaa55) {
+    LOG_ERROR("Invalid partition signature %04x", mbr->signature);
+    return -2;
+  }
+
+  LOG_INFO("Found valid partition signature");
+
+  // We already have length from partition table, so just display
+//  LOG_INFO("Partition size is %d", (unsigned int)bootSector->totalSectors32);
+
+  if (bootSector->totalSectors32 != vol->part.length) {
+    LOG_ERROR("Error: Wrong partition size");
+    return -2;
+  }
+  // reserved sectors are the sectors before the FAT including boot sector
+//  LOG_INFO("Reserved sectors = %d", (unsigned int)bootSector->reservedSectors);
+
+//  LOG_INFO("Bytes per sector %d", (unsigned int)bootSector->bytesPerSector);
+
+  if (bootSector->bytesPerSector != 512) {
+    // the caches and cluster math assume 512 byte sectors
+    LOG_ERROR("Error: incompatible sector length");
+    return -3;
+  }
+  // hidden sectors are the sectors on disk preceding partition
+//  LOG_INFO("Hidden sectors %d", (unsigned int)bootSector->hiddenSectors);
+  LOG_INFO("Sectors per cluster =  %d", (unsigned int)bootSector->sectorsPerCluster);
+  LOG_INFO("Number of FATs =  %d", (unsigned int)bootSector->numberOfFATs);
+  LOG_INFO("Sectors per FAT =  %d", (unsigned int)bootSector->sectorsPerFAT32);
+
+  // The cluster where the root directory is at
+  LOG_INFO("Root cluster = %d", (unsigned int)bootSector->rootCluster);
+//  LOG_INFO("FSInfo structure is at sector %d", (unsigned int)bootSector->fsInfo);
+//  LOG_INFO("Backup boot sector is at sector %d", (unsigned int)bootSector->backupBootSector);
+
+
+  // Sector on disk where FAT is (from start of disk)
+  uint32_t fatStart = vol->part.startAddress +
+      bootSector->reservedSectors;
+
+  vol->part.startFatSector = fatStart;
+  vol->part.sectorsPerFAT = bootSector->sectorsPerFAT32;
+  LOG_INFO("FATs start at sector %d", (unsigned int)fatStart);
+
+  // Sector on disk where data clusters start
+  // Cluster count start from 2
+  // So this sector is where cluster 2 is allocated on disk
+  uint32_t clusterStart = fatStart + bootSector->numberOfFATs *
+      bootSector->sectorsPerFAT32;
+
+  vol->part.dataStartSector = clusterStart;
+  vol->part.numberOfFATs = bootSector->numberOfFATs;
+  vol->part.mirrorSectors =
+      (bootSector->sectorsPerFAT32 + FAT_MIRROR_MAP_BITS - 1) / FAT_MIRROR_MAP_BITS;
+
+  uint32_t backupBootSector = 0; // set if the backup needs new flags
+  if (bootSector->flags & 0x80) {
+    // mirroring disabled on the volume - use the active FAT only
+    uint32_t activeFAT = bootSector->flags & 0x0f;
+    vol->part.startFatSector +=
+        activeFAT * bootSector->sectorsPerFAT32;
+    vol->part.mirrored = 0;
+    LOG_INFO("FAT mirroring disabled, active FAT %u", (unsigned int)activeFAT);
+  } else if ((mountOptions & FAT_OPT_SINGLE_FAT) && bootSector->numberOfFATs > 1) {
+    // mark the first FAT as the only active one, so that other
+    // implementations don't use the stale copies
+    bootSector->flags = (bootSector->flags & ~0x8f) | 0x80;
+    FAT_WriteSector(vol->part.startAddress);
+    if (bootSector->backupBootSector &&
+        bootSector->backupBootSector < bootSector->reservedSectors) {
+      backupBootSector = vol->part.startAddress +
+          bootSector->backupBootSector;
+    }
+    vol->part.mirrored = 0;
+    LOG_INFO("FAT mirroring disabled by mount option");
+  } else {
+    vol->part.mirrored = 1;
+  }
+
+  uint32_t sectorsPerCluster = bootSector->sectorsPerCluster;
+
+  // needed for mapping clusters to sectors
+  vol->part.sectorsPerCluster = sectorsPerCluster;
+
+  // clusters which fit in the partition and have an entry in the FAT
+  uint32_t clusterCount = (vol->part.startAddress +
+      vol->part.length - clusterStart) / sectorsPerCluster;
+  if (clusterCount > bootSector->sectorsPerFAT32 * 128 - 2) {
+    clusterCount = bootSector->sectorsPerFAT32 * 128 - 2;
+  }
+  vol->part.clusterCount = clusterCount;
+  vol->part.nextFreeCluster = 2;
+  vol->part.freeClusters = UINT32_MAX;
+  vol->part.fsInfoSector = 0;
+  vol->part.fsInfoDirty = 0;
+
+  vol->part.bytesPerSector = bootSector->bytesPerSector;
+
+  uint32_t rootCluster = bootSector->rootCluster;
+
+  vol->part.rootDirSector = FAT_Cluster2Sector(rootCluster);
+  vol->part.rootDirCluster = bootSector->rootCluster;
+
+  // FSInfo holds free cluster count and allocation hint
+  // (read last, as it replaces the boot sector in the cache)
+  uint32_t fsInfoSector = bootSector->fsInfo;
+  if (fsInfoSector && fsInfoSector < bootSector->reservedSectors) {
+    fsInfoSector += vol->part.startAddress;
+    FAT_FSInfo* fsInfo = (FAT_FSInfo*)FAT_ReadSector(fsInfoSector);
+    if (fsInfo->leadSignature == 0x41615252 &&
+        fsInfo->structSignature == 0x61417272 &&
+        fsInfo->trailSignature == 0xaa550000) {
+      vol->part.fsInfoSector = fsInfoSector;
+      if (fsInfo->freeCount <= clusterCount) {
+        vol->part.freeClusters = fsInfo->freeCount;
+      }
+      if (fsInfo->nextFree >= 2 && fsInfo->nextFree <= clusterCount + 1) {
+        vol->part.nextFreeCluster = fsInfo->nextFree;
+      }
+      LOG_INFO("FSInfo: free clusters %u, next free %u",
+          (unsigned int)fsInfo->freeCount, (unsigned int)fsInfo->nextFree);
+    }
+  }
+
+  if (backupBootSector) {
+    bootSector = (FAT32_BootSector*)FAT_ReadSector(backupBootSector);
+    if (bootSector->signature == 0xaa55) {
+      bootSector->flags = (bootSector->flags & ~0x8f) | 0x80;
+      FAT_WriteSector(backupBootSector);
+    }
+  }
+  // save boot sector changes right away
+  FAT_CacheFlush();
+
+  for (int i = 0; i < FAT_DIR_INDEXES; i++) {
+    vol->dirIndexes[i].cluster = 0;
+    vol->dirIndexes[i].lastUsed = 0;
+  }
+  vol->dirIndexStamp = 0;
+  for (int i = 0; i < FAT_PATH_CACHE_ENTRIES; i++) {
+    vol->pathCache[i].path[0] = 0;
+    vol->pathCache[i].lastUsed = 0;
+  }
+  vol->pathCacheStamp = 0;
+  vol->mounted = 1;
+
+  if (FAT_JournalOpen() == -1) {
+    vol->mounted = 0;
+    return -4;
+  }
+
+  return 0;
+}
+/**
+ * @brief Writes metadata and all cached sectors of the volume to the card.
+ *
+ * @details FSInfo is updated and the FAT is mirrored to all copies.
+ * With journaling this commits the open transaction, so directory
+ * entries of all files in it are updated as well.
+ */
+static void FAT_SyncVolume(void) {
+
+  if (vol->journal.files) {
+    for (int i = 0; i < MAX_OPENED_FILES; i++) {
+      if (openedFiles[i].id != -1 && openedFiles[i].volume == vol - volumes &&
+          openedFiles[i].entryDirty) {
+        FAT_UpdateRootEntry(i);
+      }
+    }
+  }
+  FAT_WriteFSInfo();
+  FAT_FATMirror();
+  FAT_CacheFlush();
+
+  // everything is on the card - nothing to roll back anymore
+  if (vol->journal.files) {
+    vol->journal.files = 0;
+    vol->journalDirty = 1;
+    FAT_JournalSave();
+  }
+}
+/**
+ * @brief Adds a found or created file to the opened files.
+ * @param file File with directory entry information and ID filled in
+ * @return ID of the file
+ */
+static int FAT_AddOpenedFile(FAT_File* file) {
+
+  file->clusterMap = 0;
+  file->clusterMapSize = 0;
+  file->clusterMapPool = -1;
+  file->buffer = 0;
+  file->contiguous = 0;
+  file->entryDirty = 0;
+  file->entryBytes = 0;
+  file->rdCursor.cluster = 0;
+  file->wrCursor.cluster = 0;
+  FAT_ExtentSeek(&file->rdCursor, file, 0);
+  FAT_ExtentSeek(&file->wrCursor, file, 0);
+  file->volume = vol - volumes;
+  openedFiles[file->id] = *file;
+
+  return file->id;
+}
+/**
+ * @brief Opens a file.
+ * @param filename Path of file, e.g. "/LOGS/2026/DATA.BIN", or
+ * 8 characters of name and 3 of extension of a file in the root
+ * directory, padded with spaces (e.g. "LOG00001BIN"). Components which
+ * aren't valid 8.3 names are looked up as long names. Paths on volumes
+ * other than 0 start with the volume ID and a colon (e.g. "1:/DATA.BIN").
+ * @return ID of file, -1 if not found or -2 if too many files are
+ * opened.
+ */
+int FAT_OpenFile(const char* filename) {
+
+  FAT_File file;
+  uint32_t dirCluster;
+  LOG_INFO("%s: Opening file %s", __FUNCTION__, filename);
+
+  filename = FAT_PathVolume(filename);
+  if (!filename ||
+      FAT_ResolvePath(filename, &dirCluster, file.filename) == -1) {
+    return -1;
+  }
+
+  if (FAT_FindFile(&file, dirCluster) == -1) {
+    return -1;
+  }
+
+  file.id = FAT_GetNextId();
+  if (file.id == -1) {
+    LOG_WARN("%s: Too many files opened", __FUNCTION__);
+    return -2;
+  }
+
+  return FAT_AddOpenedFile(&file);
+}
+/**
+ * @brief Creates a new empty file and opens it.
+ *
+ * @details The entry is taken from the free slot hint of the directory,
+ * so only entries which may be free are read. A full directory
+ * gets another cluster. The entry is written to the card before the
+ * function returns.
+ *
+ * @param filename Path of new file in an existing directory (see
+ * FAT_OpenFile)
+ * @return ID of the opened file, -1 if the file exists, the name is
+ * invalid or the directory doesn't exist or is full, or -2 if too many
+ * files are opened.
+ */
+int FAT_NewFile(const char* filename) {
+
+  FAT_File file;
+  uint32_t dirCluster;
+
+  file.id = FAT_GetNextId();
+  if (file.id == -1) {
+    LOG_WARN("%s: Too many files opened", __FUNCTION__);
+    return -2;
+  }
+
+  LOG_INFO("%s: Creating file %s", __FUNCTION__, filename);
+
+  filename = FAT_PathVolume(filename);
+  if (!filename ||
+      FAT_ResolvePath(filename, &dirCluster, file.filename) == -1 ||
+      file.filename[0] == '.') {
+    return -1;
+  }
+
+  // file already exists
+  if (FAT_FindFile(&file, dirCluster) != -1) {
+    return -1;
+  }
+
+  uint32_t sector, index;
+  if (FAT_FindFreeSlot(dirCluster, &sector, &index) == -1) {
+    LOG_WARN("%s: Directory full", __FUNCTION__);
+    return -1;
+  }
+
+  // 1.1.1980 00:00:00 if there is no clock
+  uint32_t dateTime = timeCallback ? timeCallback() : 0x00210000;
+
+  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(sector);
+  dirEntry += index;
+  memset(dirEntry, 0, sizeof(FAT_RootDirEntry));
+  memcpy(dirEntry->filename, file.filename, 11);
+  FAT_DirIndex* dirIndex = FAT_DirIndexGet(dirCluster);
+  if (FAT_DirIndexAdd(dirIndex, file.filename, sector, index) == -1) {
+    dirIndex->cluster = 0; // rebuild without the removed entries
+  }
+  dirEntry->attributes = 0x20; // archive
+  dirEntry->creationDate = dateTime >> 16;
+  dirEntry->creationTime = dateTime & 0xffff;
+  dirEntry->lastAccess = dateTime >> 16;
+  dirEntry->lastModifiedDate = dateTime >> 16;
+  dirEntry->lastModifiedTime = dateTime & 0xffff;
+  FAT_WriteSector(sector);
+  FAT_SyncVolume();
+
+  file.firstCluster = 0;
+  file.fileSize = 0;
+  file.attributes = 0x20;
+  file.lastModifiedDate = dateTime >> 16;
+  file.lastModifiedTime = dateTime & 0xffff;
+  file.dirSector = sector;
+  file.dirIndex = index;
+  file.rdPtr = 0;
+  file.wrPtr = 0;
+
+  return FAT_AddOpenedFile(&file);
+}
+/**
+ * @brief Deletes a file.
+ *
+ * @details The directory entry, together with its long name entries,
+ * is marked deleted and written to the card first, then the cluster
+ * chain is released a FAT sector at a time. A power loss in between
+ * leaves lost clusters, never an entry pointing to free ones.
+ * Directories and read-only files can't be deleted.
+ *
+ * @param filename Path of file (see FAT_OpenFile)
+ * @retval 0 File deleted
+ * @retval -1 Error: file not found, opened, read-only or a directory
+ */
+int FAT_DeleteFile(const char* filename) {
+
+  FAT_File file;
+  uint32_t dirCluster;
+
+  LOG_INFO("%s: Deleting file %s", __FUNCTION__, filename);
+
+  filename = FAT_PathVolume(filename);
+  if (!filename ||
+      FAT_ResolvePath(filename, &dirCluster, file.filename) == -1 ||
+      FAT_FindFile(&file, dirCluster) == -1) {
+    return -1;
+  }
+  if (file.attributes & 0x10) {
+    // not supported - nothing would drop it from the path cache
+    LOG_WARN("%s: %s is a directory", __FUNCTION__, filename);
+    return -1;
+  }
+  if (file.attributes & 0x01) {
+    LOG_WARN("%s: %s is read-only", __FUNCTION__, filename);
+    return -1;
+  }
+  for (int i = 0; i < MAX_OPENED_FILES; i++) {
+    if (openedFiles[i].id != -1 && openedFiles[i].volume == vol - volumes &&
+        openedFiles[i].dirSector == file.dirSector &&
+        openedFiles[i].dirIndex == file.dirIndex) {
+      LOG_WARN("%s: File is opened", __FUNCTION__);
+      return -1;
+    }
+  }
+
+  uint32_t slot = FAT_DirSlot(dirCluster, file.dirSector, file.dirIndex);
+  FAT_DirIndex* dirIndex = FAT_DirIndexGet(dirCluster);
+  FAT_DirIndexRemove(dirIndex, file.filename, file.dirSector, file.dirIndex);
+  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(file.dirSector);
+  dirEntry[file.dirIndex].filename[0] = 0xe5;
+  FAT_WriteSector(file.dirSector);
+
+  // long name entries precede the short entry, the one with
+  // the 0x40 flag is the first of them
+  FAT_DirWalk walk;
+  walk.first = dirCluster;
+  walk.index = UINT32_MAX;
+  while (slot && slot != UINT32_MAX) {
+    uint32_t sector = FAT_DirSector(&walk, slot - 1);
+    if (!sector) {
+      break;
+    }
+    FAT_LongDirEntry* longEntry = (FAT_LongDirEntry*)FAT_ReadSector(sector);
+    longEntry += (slot - 1) % 16;
+    if (longEntry->attributes != 0x0f || longEntry->order == 0xe5) {
+      break;
+    }
+    slot--;
+    uint8_t order = longEntry->order;
+    longEntry->order = 0xe5;
+    FAT_WriteSector(sector);
+    if (order & 0x40) {
+      break;
+    }
+  }
+
+  if (dirIndex && slot < dirIndex->freeSlot) {
+    dirIndex->freeSlot = slot;
+  }
+
+  // the entry must be gone from the card before its clusters can be
+  // reused; releasing them isn't journaled, so this also commits
+  // pending appends
+  FAT_SyncVolume();
+
+  FAT_FreeChain(file.firstCluster);
+
+  FAT_SyncVolume();
+  return 0;
+}
+/**
+ * @brief Writes all cached data of a file to the card.
+ *
+ * @details After this function returns the data written
+ * to the file so far, together with its size in the directory
+ * entry, survives a power loss.
+ *
+ * @param file ID of file
+ * @retval 0 File synchronized
+ * @retval -1 Error: file not opened
+ */
+int FAT_Sync(int file) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  if (openedFiles[file].entryDirty) {
+    FAT_UpdateRootEntry(file);
+  }
+  FAT_SyncVolume();
+  return 0;
+}
+/**
+ * @brief Close a file.
+ *
+ * @details Cached data of the file is written to the card.
+ *
+ * @param file ID of file
+ * @return ID of closed file (won't be useful anymore) or -1 if error.
+ */
+int FAT_CloseFile(int file) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1; // EOF for not open file
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  FAT_Sync(file);
+
+  // return cluster map table to the pool
+  if (openedFiles[file].clusterMapPool != -1) {
+    clusterMapPoolUsed[(int)openedFiles[file].clusterMapPool] = 0;
+  }
+  // return private buffer to the pool
+  if (openedFiles[file].buffer) {
+    openedFiles[file].buffer->sector = UINT32_MAX;
+    vol->fileBufferUsed[openedFiles[file].buffer - &vol->sectorCache[FAT_CACHE_SECTORS]] = 0;
+  }
+
+  // close file if no errors
+  openedFiles[file].id = -1;
+  return file;
+}
+/**
+ * @brief Move the read pointer to new location in file
+ * @param file File ID
+ * @param newWrPtr New read pointer location
+ * @return New read pointer location or -1 if error ocurred.
+ */
+int FAT_MoveRdPtr(int file, int newWrPtr) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1; // EOF for not open file
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  // Can't move beyond length of file for read
+  if (newWrPtr > openedFiles[file].fileSize) {
+    LOG_TRACE("%s: EOF reached", __FUNCTION__);
+    return -1;
+  }
+
+  // if no errors - move the read pointer
+  openedFiles[file].rdPtr = newWrPtr;
+  FAT_ExtentSeek(&openedFiles[file].rdCursor, &openedFiles[file], newWrPtr);
+  return newWrPtr;
+}
+/**
+ * @brief Move the write pointer to new location in file.
+ *
+ * @details The pointer may be moved past the end of the file. The file
+ * isn't changed until the next write, which fills the gap with zeros.
+ *
+ * @param file File ID
+ * @param newWrPtr New write pointer location
+ * @return New write pointer location or -1 if error ocurred.
+ */
+int FAT_MoveWrPtr(int file, int newWrPtr) {
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1; // EOF for not open file
+  }
+  vol = &volumes[openedFiles[file].volume];
+  if (newWrPtr < 0) {
+    return -1;
+  }
+
+  openedFiles[file].wrPtr = newWrPtr;
+  FAT_ExtentSeek(&openedFiles[file].wrCursor, &openedFiles[file], newWrPtr);
+  return newWrPtr;
+}
+/**
+ * @brief Enables fast seek for a file.
+ *
+ * @details Walks the cluster chain of the file once and stores it as
+ * runs of adjacent clusters. Afterwards seeking and locating data in the
+ * file costs no FAT accesses. The table layout is:
+ * table[0] - number of runs n, table[1+2*i] - index of first cluster of
+ * run i in the file, table[2+2*i] - first cluster of run i,
+ * table[1+2*n] - number of clusters in the file.
+ *
+ * @param file ID of file
+ * @param table Table for the map or 0 to take a table from the pool
+ * @param size Size of table in 32-bit words (ignored for pool tables)
+ * @retval 0 Fast seek enabled
+ * @retval -1 Error: file not opened or no free table in the pool
+ * @retval >0 Error: table too small, required table size in words
+ */
+int FAT_SetClusterMap(int file, uint32_t* table, uint32_t size) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  int pool = -1;
+
+  if (!table) {
+    for (int i = 0; i < FAT_CLUSTER_MAP_POOL; i++) {
+      if (!clusterMapPoolUsed[i]) {
+        pool = i;
+        break;
+      }
+    }
+    if (pool == -1) {
+      LOG_WARN("%s: No free cluster map", __FUNCTION__);
+      return -1;
+    }
+    table = clusterMapPool[pool];
+    size = FAT_CLUSTER_MAP_WORDS;
+  }
+
+  uint32_t runs = 0;
+  uint32_t index = 0;
+  uint32_t cluster = openedFiles[file].firstCluster;
+  uint32_t prevCluster = 0;
+
+  // walk the chain and note where adjacency breaks
+  while (cluster >= 2 && !FAT_IS_EOC(cluster)) {
+    if (cluster != prevCluster + 1 || index == 0) {
+      if (2 + 2*runs < size) {
+        table[1 + 2*runs] = index;
+        table[2 + 2*runs] = cluster;
+      }
+      runs++;
+    }
+    prevCluster = cluster;
+    cluster = FAT_GetEntryInFAT(cluster);
+    index++;
+  }
+
+  if (2 + 2*runs > size) {
+    LOG_WARN("%s: Map needs %u words", __FUNCTION__, (unsigned int)(2 + 2*runs));
+    return 2 + 2*runs;
+  }
+
+  table[0] = runs;
+  table[1 + 2*runs] = index;
+
+  // release previous pool table
+  if (openedFiles[file].clusterMapPool != -1) {
+    clusterMapPoolUsed[(int)openedFiles[file].clusterMapPool] = 0;
+  }
+  if (pool != -1) {
+    clusterMapPoolUsed[pool] = 1;
+  }
+
+  openedFiles[file].clusterMap = table;
+  openedFiles[file].clusterMapSize = size;
+  openedFiles[file].clusterMapPool = pool;
+  openedFiles[file].rdCursor.map = table;
+  openedFiles[file].wrCursor.map = table;
+  // first run is the contiguous part of the file
+  openedFiles[file].contiguous = runs ? table[3] : 0;
+  FAT_ExtentSetContiguous(&openedFiles[file]);
+
+  LOG_INFO("%s: %u clusters in %u runs", __FUNCTION__,
+      (unsigned int)index, (unsigned int)runs);
+
+  return 0;
+}
+/**
+ * @brief Reserves contiguous space for a file.
+ *
+ * @details Appends one run of adjacent clusters to the file, so that
+ * at least the given number of bytes fit in its clusters. The run is
+ * linked in the FAT at once, so writing the reserved space later needs
+ * no allocation and no FAT access, and is done with long multi-sector
+ * transfers. File size doesn't change, reserved clusters stay with the
+ * file after it's closed.
+ *
+ * @param file ID of file
+ * @param bytes Number of bytes the file should have room for
+ * @retval 0 Space reserved
+ * @retval -1 Error: file not opened or no run of free clusters long enough
+ */
+int FAT_Preallocate(int file, uint32_t bytes) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  FAT_File* f = &openedFiles[file];
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t clusterSize = part->sectorsPerCluster * 512;
+  uint32_t needed = bytes / clusterSize + (bytes % clusterSize ? 1 : 0);
+
+  // find the last cluster
+  uint32_t clusters = 0;
+  uint32_t lastCluster = 0;
+  uint32_t cluster = f->firstCluster;
+  while (cluster >= 2 && !FAT_IS_EOC(cluster)) {
+    lastCluster = cluster;
+    cluster = (clusters + 1 < f->contiguous) ? cluster + 1 :
+        FAT_GetEntryInFAT(cluster);
+    clusters++;
+  }
+
+  if (clusters >= needed) {
+    return 0;
+  }
+  needed -= clusters;
+
+  FAT_JournalReserve(f);
+
+  // prefer the run right after the last cluster
+  uint32_t first = FAT_FindFreeRun(lastCluster ? lastCluster + 1 :
+      part->nextFreeCluster, needed);
+  if (!first) {
+    LOG_WARN("%s: No %u contiguous free clusters", __FUNCTION__,
+        (unsigned int)needed);
+    return -1;
+  }
+
+  FAT_LinkRun(first, needed);
+  FAT_JournalAddRun(f, first, needed, lastCluster);
+
+  if (lastCluster) {
+    FAT_SetEntryInFAT(lastCluster, first);
+    if (f->contiguous == clusters && first == lastCluster + 1) {
+      f->contiguous += needed;
+    }
+  } else {
+    f->firstCluster = first;
+    f->contiguous = needed;
+    FAT_MarkEntryDirty(file, 0);
+  }
+  for (uint32_t i = 0; i < needed; i++) {
+    FAT_MapAppend(f, first + i);
+  }
+  FAT_ExtentSetContiguous(f);
+
+  // iterators of an empty file have no cluster yet
+  if (!lastCluster) {
+    FAT_ExtentSeek(&f->rdCursor, f, f->rdPtr);
+    FAT_ExtentSeek(&f->wrCursor, f, f->wrPtr);
+  }
+
+  part->nextFreeCluster = first + needed;
+  part->fsInfoDirty = 1;
+
+  LOG_INFO("%s: %u clusters at %u", __FUNCTION__, (unsigned int)needed,
+      (unsigned int)first);
+
+  return 0;
+}
+/**
+ * @brief Shortens a file.
+ *
+ * @details Clusters past the new end of the file, including space
+ * reserved with FAT_Preallocate, are released a FAT sector at a time.
+ * Read and write pointers beyond the new size are moved to the end
+ * of the file. The change is written to the card before the function
+ * returns.
+ *
+ * @param file ID of file
+ * @param size New size of file in bytes
+ * @retval 0 File truncated
+ * @retval -1 Error: file not opened or size larger than file
+ */
+int FAT_Truncate(int file, uint32_t size) {
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    return -1;
+  }
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[file].volume];
+
+  FAT_File* f = &openedFiles[file];
+
+  if (size > f->fileSize) {
+    return -1;
+  }
+
+  // releasing clusters isn't journaled - commit pending appends first
+  if (vol->journal.files) {
+    FAT_SyncVolume();
+  }
+
+  uint32_t clusterSize = vol->part.sectorsPerCluster * 512;
+  uint32_t keep = (size + clusterSize - 1) / clusterSize; // clusters left
+
+  if (f->firstCluster >= 2) {
+    if (!keep) {
+      FAT_FreeChain(f->firstCluster);
+      f->firstCluster = 0;
+    } else {
+      // the iterator stays at the end of the last kept cluster
+      FAT_Extent ext;
+      ext.cluster = 0;
+      FAT_ExtentSeek(&ext, f, keep * clusterSize);
+      if (ext.cluster >= 2 && !FAT_IS_EOC(ext.cluster)) {
+        uint32_t next = FAT_GetEntryInFAT(ext.cluster);
+        if (!FAT_IS_EOC(next)) {
+          FAT_SetEntryInFAT(ext.cluster, FAT_LAST_CLUSTER);
+          FAT_FreeChain(next);
+        }
+      }
+    }
+  }
+
+  if (f->contiguous > keep) {
+    f->contiguous = keep;
+  }
+  // drop runs starting past the new end
+  if (f->clusterMap) {
+    uint32_t* map = f->clusterMap;
+    uint32_t runs = map[0];
+    while (runs && map[1 + 2*(runs-1)] >= keep) {
+      runs--;
+    }
+    map[0] = runs;
+    map[1 + 2*runs] = keep;
+  }
+
+  f->fileSize = size;
+  if (f->rdPtr > size) {
+    f->rdPtr = size;
+  }
+  if (f->wrPtr > size) {
+    f->wrPtr = size;
+  }
+  // cursors may point at released clusters
+  f->rdCursor.cluster = 0;
+  f->wrCursor.cluster = 0;
+  FAT_ExtentSeek(&f->rdCursor, f, f->rdPtr);
+  FAT_ExtentSeek(&f->wrCursor, f, f->wrPtr);
+
+  FAT_MarkEntryDirty(file, 0);
+  return FAT_Sync(file);
+}
+/**
+ * @brief Reads contents of file.
+ * @param file ID of opened file
+ * @param data Buffer for storing data
+ * @param count Number of bytes to read
+ * @return Number of bytes read or -1 for EOF
+ *
+ * @details Whole sectors at a sector-aligned read pointer are read
+ * directly into the data buffer with a single multi-sector read
+ * per run of contiguous clusters. Only the unaligned head and tail
+ * of the request go through the sector cache.
+ */
+int FAT_ReadFile(int file, uint8_t* data, int count) {
+
+  LOG_TRACE("%s", __FUNCTION__);
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    LOG_ERROR("Maximum number of files open");
+    return -1;
+  }
+
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    LOG_ERROR("File not open");
+    return -1; // EOF for not open file
+  }
+  vol = &volumes[openedFiles[file].volume];
+  if (count <= 0) {
+    return 0;
+  }
+  // We have already reached EOF
+  if (openedFiles[file].rdPtr >= openedFiles[file].fileSize) {
+    LOG_TRACE("EOF reached");
+    return -1;
+  }
+
+  // don't read past EOF
+  uint32_t wanted = openedFiles[file].fileSize - openedFiles[file].rdPtr;
+  if ((uint32_t)count < wanted) {
+    wanted = count;
+  }
+
+  uint32_t len = 0; // number of bytes read
+
+  // continue from where the last read ended
+  FAT_Extent* ext = &openedFiles[file].rdCursor;
+
+  LOG_TRACE("%s: reading data", __FUNCTION__);
+  while (len < wanted) {
+
+    uint32_t inSector = openedFiles[file].rdPtr % 512;
+    uint32_t baseSector;
+    uint32_t chunk;
+
+    if (inSector == 0 && wanted - len >= 512) {
+      // whole sectors - read the contiguous run straight
+      // into the caller's buffer
+      uint32_t sectors = FAT_ExtentGet(ext, (wanted - len) / 512, &baseSector);
+      if (!sectors) {
+        break; // broken cluster chain
+      }
+      FAT_ReadSectorsDirect(data + len, baseSector, sectors);
+      FAT_ExtentAdvance(ext, sectors);
+      chunk = sectors * 512;
+    } else {
+      // partial sector - go through the cache
+      if (!FAT_ExtentGet(ext, 1, &baseSector)) {
+        break; // broken cluster chain
+      }
+      uint8_t* ptr = FAT_GetFileSector(&openedFiles[file], baseSector, 1) + inSector;
+      // copy up to the end of the sector or the request at once
+      chunk = 512 - inSector;
+      if (chunk > wanted - len) {
+        chunk = wanted - len;
+      }
+      memcpy(data + len, ptr, chunk);
+      if (inSector + chunk == 512) {
+        FAT_ExtentAdvance(ext, 1);
+      }
+    }
+
+    len += chunk;
+    openedFiles[file].rdPtr += chunk;
+  }
+
+  return len;
+}
+/**
+ * @brief Writes data to a file
+ * @param file ID of file, to which we write data.
+ * @param data Data to write
+ * @param count Number of bytes to write
+ * @return Number of bytes written.
+ *
+ * @details Whole sectors at a sector-aligned write pointer are written
+ * directly from the data buffer with a single multi-sector write
+ * per run of contiguous clusters. When the write pointer reaches the
+ * end of the cluster chain, new clusters are appended to the file.
+ * If the write pointer was moved past the end of the file, the gap is
+ * filled with zeros first. Fewer bytes than requested are written only
+ * if the volume is full.
+ */
+int FAT_WriteFile(int file, const uint8_t* data, int count) {
+
+  LOG_TRACE("%s", __FUNCTION__);
+
+  // if incorrect file ID
+  if (file < 0 || file >= MAX_OPENED_FILES) {
+    LOG_ERROR("Maximum number of files open");
+    return -1;
+  }
+
+  // File not opened
+  if (openedFiles[file].id == -1) {
+    LOG_ERROR("File not open");
+    return -1; // EOF for not open file
+  }
+  vol = &volumes[openedFiles[file].volume];
+  if (count <= 0) {
+    return 0;
+  }
+
+  // fill the gap up to the write pointer, a sector at a time
+  uint32_t gapEnd = openedFiles[file].wrPtr;
+  if (gapEnd > openedFiles[file].fileSize) {
+    static const uint8_t zeros[512];
+    FAT_MoveWrPtr(file, openedFiles[file].fileSize);
+    while (openedFiles[file].wrPtr < gapEnd) {
+      uint32_t n = 512 - openedFiles[file].wrPtr % 512;
+      if (n > gapEnd - openedFiles[file].wrPtr) {
+        n = gapEnd - openedFiles[file].wrPtr;
+      }
+      if (FAT_WriteFile(file, zeros, n) != (int)n) {
+        return 0; // volume full
+      }
+    }
+  }
+
+  uint32_t wanted = count;
+  uint32_t len = 0; // number of bytes written
+
+  // appends are rolled back after a power loss until they are committed
+  if (openedFiles[file].wrPtr + wanted > openedFiles[file].fileSize) {
+    FAT_JournalBegin(&openedFiles[file]);
+  }
+
+  // continue from where the last write ended
+  FAT_Extent* ext = &openedFiles[file].wrCursor;
+
+  LOG_TRACE("%s: writing data", __FUNCTION__);
+  while (len < wanted) {
+
+    uint32_t inSector = openedFiles[file].wrPtr % 512;
+    uint32_t baseSector;
+    uint32_t chunk;
+
+    // end of cluster chain - append clusters for the rest of the data
+    if (!FAT_ExtentGet(ext, 1, &baseSector) &&
+        FAT_ExtendFile(&openedFiles[file], ext,
+            (inSector + wanted - len + 511) / 512) == -1) {
+      break;
+    }
+
+    if (inSector == 0 && wanted - len >= 512) {
+      // whole sectors - write the contiguous run straight
+      // from the caller's buffer
+      uint32_t sectors = FAT_ExtentGet(ext, (wanted - len) / 512, &baseSector);
+      if (!sectors) {
+        break; // broken cluster chain
+      }
+      FAT_WriteSectorsDirect(data + len, baseSector, sectors);
+      FAT_ExtentAdvance(ext, sectors);
+      chunk = sectors * 512;
+    } else {
+      // partial sector - read-modify-write through the cache
+      if (!FAT_ExtentGet(ext, 1, &baseSector)) {
+        break; // broken cluster chain
+      }
+      // copy up to the end of the sector or the request at once
+      chunk = 512 - inSector;
+      if (chunk > wanted - len) {
+        chunk = wanted - len;
+      }
+      // bytes of the sector holding file data before this write
+      uint32_t sectorStart = openedFiles[file].wrPtr - inSector;
+      uint32_t valid = 0;
+      if (openedFiles[file].fileSize > sectorStart) {
+        valid = openedFiles[file].fileSize - sectorStart;
+      }
+      // no need to read the sector if the write covers all its data
+      uint8_t load = valid && (inSector || chunk < valid);
+      uint8_t* ptr = FAT_GetFileSector(&openedFiles[file], baseSector, load) +
+          inSector;
+      memcpy(ptr, data + len, chunk);
+      FAT_WriteSector(baseSector); // save data
+      if (inSector + chunk == 512) {
+        FAT_ExtentAdvance(ext, 1);
+      }
+    }
+
+    len += chunk;
+    openedFiles[file].wrPtr += chunk;
+
+    // check if EOF reached and update file size
+    if (openedFiles[file].wrPtr > openedFiles[file].fileSize) {
+      // if writing to end of file - increment filesize
+      openedFiles[file].fileSize = openedFiles[file].wrPtr;
+    }
+  }
+
+  if (len > 0) {
+    FAT_MarkEntryDirty(file, len);
+  }
+
+  vol->dirtyBytes += len;
+  FAT_CacheCheckFlush();
+
+  return len;
+
+}
+/**
+ * @brief Opens a ring file, creating it if it doesn't exist.
+ *
+ * @details A ring file is preallocated as one contiguous run and
+ * written cyclically in fixed-size records, the newest record
+ * replacing the oldest one once the ring is full. Writing a record
+ * changes neither the FAT nor the directory entry, only the data
+ * sector holding it and, every FAT_RING_HEADER_RECORDS records, the
+ * header sector at the start of the file. Records written after the
+ * last header update are recovered when the ring is opened, by
+ * checking the stamps of the following slots.
+ *
+ * A new ring is zero filled once, so that stale data isn't taken for
+ * records. The directory entry and the header are written to the
+ * card before the function returns. If that is interrupted, the ring
+ * is zero filled again when it's next opened.
+ *
+ * @param filename Name of file: 8 characters of name and 3 of
+ * extension, padded with spaces (e.g. "EVENTS  LOG")
+ * @param size Size of new file in bytes, including the header sector
+ * @param recordSize Size of a record in bytes
+ * @return ID of the ring or -1 if the file is not a ring with the
+ * same record size, its slots don't fit in its contiguous part, there
+ * is no contiguous space for it or too many files or rings are opened.
+ */
+int FAT_OpenRing(const char* filename, uint32_t size, uint16_t recordSize) {
+
+  int ringId = 0;
+  while (ringId < FAT_MAX_RINGS && rings[ringId].file != -1) {
+    ringId++;
+  }
+  if (ringId == FAT_MAX_RINGS || !recordSize || !FAT_PathVolume(filename)) {
+    return -1;
+  }
+
+  FAT_Ring* ring = &rings[ringId];
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t clusterSize = part->sectorsPerCluster * 512;
+  FAT_RingHeader* header = 0;
+
+  int file = FAT_OpenFile(filename);
+  if (file == -2) {
+    return -1;
+  }
+
+  if (file == -1) {
+    // round up to whole clusters - all of the file is used
+    size = (size + clusterSize - 1) / clusterSize * clusterSize;
+    if (size < 512 + 4 + (uint32_t)recordSize) {
+      return -1;
+    }
+    file = FAT_NewFile(filename);
+    if (file < 0) {
+      return -1;
+    }
+    if (FAT_Preallocate(file, size) == -1) {
+      FAT_CloseFile(file);
+      FAT_DeleteFile(filename);
+      return -1;
+    }
+    openedFiles[file].fileSize = size;
+    FAT_MarkEntryDirty(file, 0);
+
+  } else {
+    FAT_File* f = &openedFiles[file];
+
+    // find the contiguous part, so that records are located without the FAT
+    uint32_t cluster = f->firstCluster;
+    uint32_t clusters = (f->fileSize + clusterSize - 1) / clusterSize;
+    f->contiguous = cluster >= 2 ? 1 : 0;
+    while (f->contiguous && f->contiguous < clusters &&
+        FAT_GetEntryInFAT(cluster) == cluster + 1) {
+      cluster++;
+      f->contiguous++;
+    }
+    FAT_ExtentSetContiguous(f);
+
+    // slots are addressed without the FAT, so they have to fit in the
+    // contiguous part - a ring to be zero filled needs all of the file
+    uint32_t span = f->contiguous * clusterSize;
+    if (span > f->fileSize) {
+      span = f->fileSize;
+    }
+
+    if (f->contiguous) {
+      header = (FAT_RingHeader*)FAT_ReadSector(FAT_Cluster2Sector(f->firstCluster));
+    }
+    if (!header || header->signature != FAT_RING_SIGNATURE ||
+        header->recordSize != recordSize ||
+        span < 512 + 4 + (uint32_t)recordSize ||
+        header->slots > (span - 512) / (4 + (uint32_t)recordSize) ||
+        (!header->slots && span < f->fileSize)) {
+      LOG_ERROR("%s: %s is not a ring of %u byte records", __FUNCTION__,
+          filename, (unsigned int)recordSize);
+      FAT_CloseFile(file);
+      return -1;
+    }
+  }
+
+  ring->file = file;
+  ring->recordSize = recordSize;
+
+  if (!header || !header->slots) {
+    // new ring or one whose creation was interrupted
+    ring->slots = (openedFiles[file].fileSize - 512) / (4 + recordSize);
+    ring->head = 0;
+    ring->tail = 0;
+    FAT_RingFormat(ring);
+    LOG_INFO("%s: Created ring %s, %u records of %u bytes", __FUNCTION__,
+        filename, (unsigned int)ring->slots, (unsigned int)recordSize);
+  } else {
+    ring->slots = header->slots;
+    ring->head = header->head;
+    ring->tail = header->tail;
+
+    // recover records written after the last header update
+    uint32_t found = 0;
+    while (found < ring->slots) {
+      uint32_t stamp;
+      FAT_RingAccess(ring, 512 + (ring->head % ring->slots) * (4 + recordSize),
+          (uint8_t*)&stamp, 4, 0);
+      if (stamp != ring->head + 1) {
+        break;
+      }
+      ring->head++;
+      found++;
+    }
+    if (ring->head - ring->tail > ring->slots) {
+      ring->tail = ring->head - ring->slots;
+    }
+    ring->unsaved = found;
+
+    LOG_INFO("%s: Opened ring %s, records %u to %u (%u recovered)",
+        __FUNCTION__, filename, (unsigned int)ring->tail,
+        (unsigned int)ring->head, (unsigned int)found);
+  }
+
+  ring->next = ring->tail;
+  return ringId;
+}
+/**
+ * @brief Appends a record to a ring file.
+ *
+ * @details The oldest record is dropped if the ring is full. The
+ * sector holding the start of the record's stamp is written last, so a
+ * stamp found on the card after a power loss means all of the
+ * record is there. Records crossing a sector boundary cost one more
+ * card write for that.
+ *
+ * @param ring ID of ring
+ * @param data Record of the size given to FAT_OpenRing
+ * @retval 0 Record written
+ * @retval -1 Error: ring not opened
+ */
+int FAT_RingWrite(int ring, const uint8_t* data) {
+
+  if (ring < 0 || ring >= FAT_MAX_RINGS || rings[ring].file == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[rings[ring].file].volume];
+
+  FAT_Ring* r = &rings[ring];
+  uint32_t offset = 512 + (r->head % r->slots) * (4 + r->recordSize);
+  uint32_t stamp = r->head + 1;
+  uint32_t size = 4 + r->recordSize;
+  uint32_t head = 512 - offset % 512; // bytes of the slot in its first sector
+
+  if (head < size) {
+    // the rest of the slot reaches the card before its first sector
+    if (head < 4) {
+      FAT_RingAccess(r, offset + head, (uint8_t*)&stamp + head, 4 - head, 1);
+      FAT_RingAccess(r, offset + 4, (uint8_t*)data, r->recordSize, 1);
+    } else {
+      FAT_RingAccess(r, offset + head, (uint8_t*)data + head - 4, size - head, 1);
+    }
+    uint32_t first = FAT_Cluster2Sector(openedFiles[r->file].firstCluster);
+    for (uint32_t i = offset / 512 + 1; i <= (offset + size - 1) / 512; i++) {
+      FAT_CacheEntry* entry = FAT_CacheFind(first + i);
+      if (entry) {
+        FAT_CacheWriteBack(entry, 0);
+      }
+    }
+  } else {
+    head = size;
+  }
+  FAT_RingAccess(r, offset, (uint8_t*)&stamp, head < 4 ? head : 4, 1);
+  if (head > 4) {
+    FAT_RingAccess(r, offset + 4, (uint8_t*)data, head - 4, 1);
+  }
+
+  r->head++;
+  if (r->head - r->tail > r->slots) {
+    r->tail++;
+  }
+  if (++r->unsaved >= FAT_RING_HEADER_RECORDS) {
+    FAT_RingSaveHeader(r);
+  }
+
+  vol->dirtyBytes += r->recordSize;
+  FAT_CacheCheckFlush();
+
+  return 0;
+}
+/**
+ * @brief Reads the next record of a ring file.
+ *
+ * @details Records are read from the oldest to the newest. Records
+ * overwritten since the previous read are skipped, as are records
+ * lost in a power failure.
+ *
+ * @param ring ID of ring
+ * @param data Buffer for the record
+ * @return Number of bytes read (the record size) or -1 if no records are left.
+ */
+int FAT_RingRead(int ring, uint8_t* data) {
+
+  if (ring < 0 || ring >= FAT_MAX_RINGS || rings[ring].file == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[rings[ring].file].volume];
+
+  FAT_Ring* r = &rings[ring];
+
+  // records older than the tail were overwritten
+  if ((int32_t)(r->next - r->tail) < 0) {
+    r->next = r->tail;
+  }
+
+  while (r->next != r->head) {
+    uint32_t offset = 512 + (r->next % r->slots) * (4 + r->recordSize);
+    uint32_t stamp;
+
+    FAT_RingAccess(r, offset, (uint8_t*)&stamp, 4, 0);
+    if (stamp == ++r->next) {
+      FAT_RingAccess(r, offset + 4, data, r->recordSize, 0);
+      return r->recordSize;
+    }
+  }
+
+  return -1;
+}
+/**
+ * @brief Moves the read position of a ring file to its oldest record.
+ * @param ring ID of ring
+ * @retval 0 Position moved
+ * @retval -1 Error: ring not opened
+ */
+int FAT_RingRewind(int ring) {
+
+  if (ring < 0 || ring >= FAT_MAX_RINGS || rings[ring].file == -1) {
+    return -1;
+  }
+  rings[ring].next = rings[ring].tail;
+  return 0;
+}
+/**
+ * @brief Closes a ring file.
+ *
+ * @details The header and cached records are written to the card.
+ *
+ * @param ring ID of ring
+ * @retval 0 Ring closed
+ * @retval -1 Error: ring not opened
+ */
+int FAT_CloseRing(int ring) {
+
+  if (ring < 0 || ring >= FAT_MAX_RINGS || rings[ring].file == -1) {
+    return -1;
+  }
+  vol = &volumes[openedFiles[rings[ring].file].volume];
+  if (rings[ring].unsaved) {
+    FAT_RingSaveHeader(&rings[ring]);
+  }
+  FAT_CloseFile(rings[ring].file);
+  rings[ring].file = -1;
+  return 0;
+}
+/**
+ * @brief Copies bytes between a ring file and a buffer.
+ *
+ * @details Goes through the sector cache (or the private buffer of
+ * the file) and doesn't touch the file pointers or its size.
+ *
+ * @param ring Ring
+ * @param offset Position in file
+ * @param data Buffer
+ * @param count Number of bytes
+ * @param write 1 - write the buffer to the file, 0 - read into it
+ */
+static void FAT_RingAccess(FAT_Ring* ring, uint32_t offset, uint8_t* data,
+    uint32_t count, uint8_t write) {
+
+  FAT_File* f = &openedFiles[ring->file];
+  FAT_Extent ext;
+  ext.cluster = 0;
+
+  while (count) {
+    uint32_t inSector = offset % 512;
+    uint32_t chunk = 512 - inSector;
+    uint32_t sector;
+
+    if (chunk > count) {
+      chunk = count;
+    }
+    FAT_ExtentSeek(&ext, f, offset - inSector);
+    if (!FAT_ExtentGet(&ext, 1, &sector)) {
+      return; // broken cluster chain
+    }
+    // a write of the whole sector doesn't need its old contents
+    uint8_t* ptr = FAT_GetFileSector(f, sector, !write || chunk < 512) + inSector;
+    if (write) {
+      memcpy(ptr, data, chunk);
+      FAT_WriteSector(sector);
+    } else {
+      memcpy(data, ptr, chunk);
+    }
+
+    offset += chunk;
+    data += chunk;
+    count -= chunk;
+  }
+}
+/**
+ * @brief Stores head and tail of a ring in its header sector.
+ * @param ring Ring
+ */
+static void FAT_RingSaveHeader(FAT_Ring* ring) {
+
+  uint32_t sector = FAT_Cluster2Sector(openedFiles[ring->file].firstCluster);
+  FAT_RingHeader* header = (FAT_RingHeader*)FAT_GetSector(sector, 0);
+
+  header->signature = FAT_RING_SIGNATURE;
+  header->recordSize = ring->recordSize;
+  header->slots = ring->slots;
+  header->head = ring->head;
+  header->tail = ring->tail;
+  FAT_WriteSector(sector);
+
+  ring->unsaved = 0;
+}
+/**
+ * @brief Zero fills the slots of an empty ring.
+ *
+ * @details The header is first written without slots, which marks the
+ * ring as not cleared yet until the final header is written.
+ *
+ * @param ring Ring with file, size and head set, the file has to be
+ * one contiguous run
+ */
+static void FAT_RingFormat(FAT_Ring* ring) {
+
+  FAT_File* f = &openedFiles[ring->file];
+  uint32_t first = FAT_Cluster2Sector(f->firstCluster);
+  uint32_t slots = ring->slots;
+
+  ring->slots = 0;
+  FAT_RingSaveHeader(ring);
+  FAT_Sync(ring->file);
+  ring->slots = slots;
+
+  // clusters released with their data still cached are zero filled
+  // in the cache too, old stamps would be taken for records
+  for (uint32_t i = 1; i < f->fileSize / 512; i++) {
+    FAT_GetSector(first + i, 0);
+    FAT_WriteSector(first + i);
+  }
+
+  FAT_RingSaveHeader(ring);
+  FAT_Sync(ring->file);
+}
+/**
+ * @brief Opens a directory for listing.
+ * @param path Path of directory, e.g. "/LOGS/2026", "/" or "" for
+ * the root directory
+ * @return ID of the directory or -1 if not found, not a directory
+ * or too many directories are opened.
+ */
+int FAT_OpenDir(const char* path) {
+
+  int dirId = 0;
+  while (dirId < FAT_MAX_DIRS && dirs[dirId].first) {
+    dirId++;
+  }
+  path = FAT_PathVolume(path);
+  if (dirId == FAT_MAX_DIRS || !path) {
+    return -1;
+  }
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t cluster = part->rootDirCluster;
+
+  if (path[0] && strcmp(path, "/")) {
+    FAT_File file;
+    if (FAT_ResolvePath(path, &cluster, file.filename) == -1 ||
+        FAT_FindFile(&file, cluster) == -1) {
+      return -1;
+    }
+    if (!(file.attributes & 0x10)) {
+      LOG_INFO("%s: %s is not a directory", __FUNCTION__, path);
+      return -1;
+    }
+    // ".." of a subdirectory of the root holds 0
+    cluster = file.firstCluster ? file.firstCluster : part->rootDirCluster;
+  }
+
+  FAT_Dir* dir = &dirs[dirId];
+  dir->first = cluster;
+  dir->volume = vol - volumes;
+  dir->cluster = cluster;
+  dir->sector = 0;
+  dir->count = 0;
+  dir->next = 0;
+  dir->slots = 0;
+
+  return dirId;
+}
+/**
+ * @brief Reads the next entry of an opened directory.
+ *
+ * @details Deleted entries, long name entries, the volume label and
+ * the "." and ".." entries are skipped. Entries are returned in the
+ * order they are stored. Files created or deleted while the directory
+ * is listed may or may not be returned.
+ *
+ * @param dir ID of directory
+ * @param info Entry (function writes this)
+ * @retval 1 Entry read
+ * @retval 0 No more entries
+ * @retval -1 Error: directory not opened
+ */
+int FAT_ReadDir(int dir, FAT_DirInfo* info) {
+
+  if (dir < 0 || dir >= FAT_MAX_DIRS || !dirs[dir].first) {
+    return -1;
+  }
+
+  FAT_Dir* d = &dirs[dir];
+  vol = &volumes[d->volume];
+
+  for (;;) {
+    if (d->next == d->count && FAT_DirFill(d) == -1) {
+      return 0;
+    }
+
+    uint32_t* words = &d->buf[d->next * 8];
+    uint32_t first = words[0] & 0xff;
+    uint32_t slot = d->next++;
+
+    // first byte of the name and attributes (byte 11) are checked
+    // as words: end marker, deleted and "." entries, labels and long names
+    if (first == 0x00) {
+      d->cluster = 0;
+      d->count = 0;
+      d->next = 0;
+      return 0;
+    }
+    if (first == 0xe5 || first == '.' || (words[2] & 0x08000000)) {
+      continue;
+    }
+
+    FAT_RootDirEntry* entry = (FAT_RootDirEntry*)words;
+    char* name = info->name;
+    for (int i = 0; i < 8 && entry->filename[i] != ' '; i++) {
+      *name++ = entry->filename[i];
+    }
+    if (entry->extension[0] != ' ') {
+      *name++ = '.';
+      for (int i = 0; i < 3 && entry->extension[i] != ' '; i++) {
+        *name++ = entry->extension[i];
+      }
+    }
+    *name = 0;
+    if (info->name[0] == 0x05) {
+      info->name[0] = 0xe5; // first character 0xe5 is stored as 0x05
+    }
+    info->attributes = entry->attributes;
+    info->size = entry->fileSize;
+    info->firstCluster = (((uint32_t)(entry->firstClusterH))<<16) |
+        (uint32_t)entry->firstClusterL;
+
+    // opened files may not have updated their entries yet
+    uint32_t sector = d->bufSector + slot / 16;
+    for (int i = 0; i < MAX_OPENED_FILES; i++) {
+      if (openedFiles[i].id != -1 && openedFiles[i].entryDirty &&
+          openedFiles[i].volume == d->volume &&
+          openedFiles[i].dirSector == sector &&
+          openedFiles[i].dirIndex == slot % 16) {
+        info->size = openedFiles[i].fileSize;
+        info->firstCluster = openedFiles[i].firstCluster;
+      }
+    }
+    return 1;
+  }
+}
+/**
+ * @brief Closes a directory.
+ * @param dir ID of directory
+ * @retval 0 Directory closed
+ * @retval -1 Error: directory not opened
+ */
+int FAT_CloseDir(int dir) {
+
+  if (dir < 0 || dir >= FAT_MAX_DIRS || !dirs[dir].first) {
+    return -1;
+  }
+  dirs[dir].first = 0;
+  return 0;
+}
+/**
+ * @brief Reads the next sectors of an opened directory into its buffer.
+ *
+ * @details Reads up to FAT_DIR_READ_SECTORS sectors, without crossing
+ * the end of the cluster, with one transfer. Dirty cached sectors are
+ * newer than the card, so they are taken from the cache.
+ *
+ * @param dir Directory
+ * @retval 0 Sectors read
+ * @retval -1 End of directory
+ */
+static int FAT_DirFill(FAT_Dir* dir) {
+
+  FAT_PartitionInfo* part = &vol->part;
+
+  if (dir->sector == part->sectorsPerCluster) {
+    dir->cluster = FAT_GetEntryInFAT(dir->cluster);
+    dir->sector = 0;
+  }
+  if (dir->cluster < 2 || dir->cluster > part->clusterCount + 1 ||
+      dir->slots >= FAT_DIR_MAX_ENTRIES) {
+    dir->cluster = 0; // end of chain
+    return -1;
+  }
+
+  uint32_t count = part->sectorsPerCluster - dir->sector;
+  if (count > FAT_DIR_READ_SECTORS) {
+    count = FAT_DIR_READ_SECTORS;
+  }
+  dir->bufSector = FAT_Cluster2Sector(dir->cluster) + dir->sector;
+  FAT_ReadSectorsDirect((uint8_t*)dir->buf, dir->bufSector, count);
+
+  dir->sector += count;
+  dir->count = count * 16;
+  dir->next = 0;
+  dir->slots += count * 16;
+  return 0;
+}
+/**
+ * @brief Updates the directory entry of a given file.
+ *
+ * @details Stores the file length, the first cluster (a file which
+ * was empty may have got one) and the modification time, if a time
+ * source was set. The entry sector is only modified in the cache.
+ *
+ * @param file File ID
+ */
+static void FAT_UpdateRootEntry(int file) {
+
+  uint32_t sector = openedFiles[file].dirSector;
+
+  // read sector where entry is at
+  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(sector);
+  dirEntry += openedFiles[file].dirIndex;
+
+  if (timeCallback) {
+    uint32_t dateTime = timeCallback();
+    openedFiles[file].lastModifiedDate = dateTime >> 16;
+    openedFiles[file].lastModifiedTime = dateTime & 0xffff;
+  }
+
+  dirEntry->fileSize = openedFiles[file].fileSize;
+  dirEntry->firstClusterH = openedFiles[file].firstCluster >> 16;
+  dirEntry->firstClusterL = openedFiles[file].firstCluster & 0xffff;
+  dirEntry->lastModifiedDate = openedFiles[file].lastModifiedDate;
+  dirEntry->lastModifiedTime = openedFiles[file].lastModifiedTime;
+
+  // name in the entry isn't terminated, so limit its length
+  LOG_TRACE("%s: Updating root entry for file: %.11s, size %u", __FUNCTION__,
+      (char*)dirEntry->filename, (unsigned int)openedFiles[file].fileSize);
+
+  FAT_WriteSector(sector);
+
+  openedFiles[file].entryDirty = 0;
+  openedFiles[file].entryBytes = 0;
+}
+/**
+ * @brief Notes a change which has to be stored in the directory entry.
+ *
+ * @details The entry is updated on sync and close, or earlier when
+ * FAT_ENTRY_COMMIT_BYTES bytes were written or the oldest change is
+ * FAT_ENTRY_COMMIT_MS old. This bounds what a power loss can cost
+ * without a directory sector update per write.
+ *
+ * @param file File ID
+ * @param bytes Number of bytes written
+ */
+static void FAT_MarkEntryDirty(int file, uint32_t bytes) {
+
+  FAT_File* f = &openedFiles[file];
+
+  if (!f->entryDirty) {
+    f->entryDirty = 1;
+    f->entrySince = TIMER_GetTime();
+  }
+  f->entryBytes += bytes;
+
+#if FAT_ENTRY_COMMIT_BYTES
+  if (f->entryBytes >= FAT_ENTRY_COMMIT_BYTES) {
+    FAT_UpdateRootEntry(file);
+    return;
+  }
+#endif
+#if FAT_ENTRY_COMMIT_MS
+  if (TIMER_GetTime() - f->entrySince >= FAT_ENTRY_COMMIT_MS) {
+    FAT_UpdateRootEntry(file);
+  }
+#endif
+}
+/**
+ * @brief Gets number of cluster clusterOffset in a file
+ *
+ * @details
+ *
+ * @param firstCluster First cluster of file
+ * @param clusterOffset Cluster from start of file we want to find
+ * @param clusterNumber The number of the searched cluster (function writes this)
+ * @return Cluster from start of file we really found
+ */
+static int FAT_GetCluster(uint32_t firstCluster, uint32_t clusterOffset,
+    uint32_t* clusterNumber) {
+
+  uint32_t entry = firstCluster;
+  int i;
+
+  for (i = 0; i < clusterOffset; i++) {
+    entry = FAT_GetEntryInFAT(entry);
+    // last cluster reached before we reached clusterOffset
+    if (FAT_IS_EOC(entry)) {
+      *clusterNumber = entry; // return the entry
+      return i;
+    }
+  }
+
+  *clusterNumber = entry; // return the entry
+  return clusterOffset;
+}
+/**
+ * @brief Finds the run of a cluster map holding a given cluster of a file.
+ *
+ * @details The map is binary searched, so no FAT access is needed.
+ *
+ * @param map Cluster map
+ * @param index Index of cluster in file
+ * @return Number of the run or -1 if the index is beyond the cluster chain.
+ */
+static int FAT_MapFind(const uint32_t* map, uint32_t index) {
+
+  int low = 0;
+  int high = map[0]; // number of runs
+
+  // run i starts at file cluster map[1+2*i], run map[0] is the end marker
+  if (index >= map[1 + 2*high]) {
+    return -1;
+  }
+
+  while (high - low > 1) {
+    int mid = (low + high) / 2;
+    if (map[1 + 2*mid] <= index) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+/**
+ * @brief Gets cluster number of a given cluster of a file.
+ * @param ext Extent iterator holding the file cluster map
+ * @param firstCluster First cluster of file
+ * @param index Index of the cluster in file
+ * @return Cluster number or end of chain marker.
+ */
+static uint32_t FAT_ExtentLookup(FAT_Extent* ext, uint32_t firstCluster,
+    uint32_t index) {
+
+  uint32_t cluster;
+
+  if (index < ext->contiguous) {
+    return ext->firstCluster + index;
+  }
+
+  if (ext->map) {
+    int run = FAT_MapFind(ext->map, index);
+    if (run == -1) {
+      return FAT_LAST_CLUSTER;
+    }
+    return ext->map[2 + 2*run] + index - ext->map[1 + 2*run];
+  }
+
+  FAT_GetCluster(firstCluster, index, &cluster);
+  return cluster;
+}
+/**
+ * @brief Positions an extent iterator at a given byte of a file.
+ *
+ * @details A pointer at a cluster boundary is kept at the end of
+ * the previous cluster, so that the following cluster is looked up
+ * only when data is actually transferred. When moving forward,
+ * the chain is walked from the current position of the iterator
+ * instead of the first cluster.
+ *
+ * @param ext Extent iterator
+ * @param file File
+ * @param ptr Byte position in file
+ */
+static void FAT_ExtentSeek(FAT_Extent* ext, FAT_File* file, uint32_t ptr) {
+
+  uint32_t sectorsPerCluster = vol->part.sectorsPerCluster;
+
+  // sector where pointer is at (counting from first sector)
+  uint32_t sectorOffset = ptr / 512;
+
+  ext->map = file->clusterMap;
+  ext->firstCluster = file->firstCluster;
+  ext->contiguous = file->contiguous;
+
+  if (sectorOffset == 0) {
+    ext->cluster = file->firstCluster;
+    ext->sectorOffset = 0;
+    ext->index = 0;
+    return;
+  }
+
+  // stay at the end of the cluster holding the previous sector
+  uint32_t index = (sectorOffset - 1) / sectorsPerCluster;
+  sectorOffset = (sectorOffset - 1) % sectorsPerCluster + 1;
+
+  if (ext->map || index < ext->contiguous) {
+    ext->cluster = FAT_ExtentLookup(ext, 0, index);
+  } else if (ext->cluster >= 2 && !FAT_IS_EOC(ext->cluster) &&
+      index >= ext->index) {
+    // resume from the cached position
+    FAT_GetCluster(ext->cluster, index - ext->index, &ext->cluster);
+  } else {
+    FAT_GetCluster(file->firstCluster, index, &ext->cluster);
+  }
+  ext->index = index;
+  ext->sectorOffset = sectorOffset;
+}
+/**
+ * @brief Gets the run of physically contiguous sectors at the iterator.
+ *
+ * @details The run continues into the following clusters as long
+ * as they are adjacent on the disk. The iterator is not moved.
+ *
+ * @param ext Extent iterator
+ * @param maxSectors Maximum number of sectors needed
+ * @param sector First sector of the run (function writes this)
+ * @return Number of sectors in the run (at most maxSectors and
+ * FAT_MAX_TRANSFER) or 0 if the end of the cluster chain was reached.
+ * In the latter case the iterator stays at the end of the last cluster.
+ */
+static uint32_t FAT_ExtentGet(FAT_Extent* ext, uint32_t maxSectors,
+    uint32_t* sector) {
+
+  uint32_t sectorsPerCluster = vol->part.sectorsPerCluster;
+
+  // end of cluster - go to next cluster in chain
+  if (ext->sectorOffset == sectorsPerCluster) {
+    uint32_t next;
+    if (ext->map || ext->index + 1 < ext->contiguous) {
+      next = FAT_ExtentLookup(ext, 0, ext->index + 1);
+    } else {
+      next = FAT_GetEntryInFAT(ext->cluster);
+    }
+    // stay at the end of the last cluster, so that
+    // the chain can be extended from there
+    if (next < 2 || FAT_IS_EOC(next)) {
+      return 0;
+    }
+    ext->cluster = next;
+    ext->sectorOffset = 0;
+    ext->index++;
+  }
+
+  if (ext->cluster < 2 || FAT_IS_EOC(ext->cluster)) {
+    return 0;
+  }
+
+  if (maxSectors > FAT_MAX_TRANSFER) {
+    maxSectors = FAT_MAX_TRANSFER;
+  }
+
+  *sector = FAT_Cluster2Sector(ext->cluster) + ext->sectorOffset;
+  uint32_t count = sectorsPerCluster - ext->sectorOffset;
+
+  if (ext->index < ext->contiguous) {
+    // rest of the contiguous part is one run
+    count += (ext->contiguous - ext->index - 1) * sectorsPerCluster;
+  } else if (ext->map) {
+    // the map knows where the run of adjacent clusters ends
+    int run = FAT_MapFind(ext->map, ext->index);
+    count += (ext->map[3 + 2*run] - ext->index - 1) * sectorsPerCluster;
+  } else {
+    // extend the run while next cluster is adjacent
+    uint32_t lastCluster = ext->cluster;
+    while (count < maxSectors) {
+      if (FAT_GetEntryInFAT(lastCluster) != lastCluster + 1) {
+        break;
+      }
+      lastCluster++;
+      count += sectorsPerCluster;
+    }
+  }
+
+  if (count > maxSectors) {
+    count = maxSectors;
+  }
+  return count;
+}
+/**
+ * @brief Moves an extent iterator forward.
+ * @param ext Extent iterator
+ * @param sectors Number of sectors to move, at most the length of
+ * the run returned by the last FAT_ExtentGet call.
+ */
+static void FAT_ExtentAdvance(FAT_Extent* ext, uint32_t sectors) {
+
+  uint32_t sectorsPerCluster = vol->part.sectorsPerCluster;
+
+  if (!sectors) {
+    return;
+  }
+
+  // clusters in a run are adjacent, so just count them
+  sectors += ext->sectorOffset;
+  ext->cluster += (sectors - 1) / sectorsPerCluster;
+  ext->index += (sectors - 1) / sectorsPerCluster;
+  ext->sectorOffset = (sectors - 1) % sectorsPerCluster + 1;
+}
+/**
+ * @brief Passes the contiguous part of a file to its iterators.
+ * @param file File
+ */
+static void FAT_ExtentSetContiguous(FAT_File* file) {
+
+  file->rdCursor.firstCluster = file->firstCluster;
+  file->rdCursor.contiguous = file->contiguous;
+  file->wrCursor.firstCluster = file->firstCluster;
+  file->wrCursor.contiguous = file->contiguous;
+}
+/**
+ * @brief Checks whether a free bitmap segment is known to be full.
+ * @param segment Segment
+ * @return 1 if segment has no free clusters, 0 if it may have some.
+ */
+static int FAT_FreeMapIsFull(uint32_t segment) {
+
+  if (segment >= FAT_FREE_SEGMENTS) {
+    return 0; // not tracked
+  }
+  return (vol->freeMapFull[segment / 32] >> (segment % 32)) & 1;
+}
+/**
+ * @brief Builds the free bitmap of a segment from the FAT.
+ * @param segment Segment
+ */
+static void FAT_FreeMapLoad(uint32_t segment) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t lastCluster = part->clusterCount + 1;
+  uint32_t first = segment * FAT_FREE_MAP_CLUSTERS;
+
+  for (int i = 0; i < FAT_FREE_MAP_CLUSTERS / 32; i++) {
+    vol->freeMap[i] = 0;
+  }
+
+  // one FAT sector holds 128 entries - 4 bitmap words
+  for (uint32_t i = 0; i < FAT_FREE_MAP_CLUSTERS && first + i <= lastCluster;
+      i += 128) {
+    uint32_t* entries = FAT_ReadFATSector(part->startFatSector + (first + i) / 128);
+    for (uint32_t k = 0; k < 128; k++) {
+      uint32_t cluster = first + i + k;
+      if (!(entries[k] & FAT_ENTRY_MASK) && cluster >= 2 &&
+          cluster <= lastCluster) {
+        vol->freeMap[(i + k) / 32] |= 1u << (k % 32);
+      }
+    }
+  }
+  vol->freeMapSegment = segment;
+
+  LOG_TRACE("%s: Loaded segment %u", __FUNCTION__, (unsigned int)segment);
+}
+/**
+ * @brief Updates free space information after a FAT entry changed
+ * between free and used.
+ * @param cluster Cluster
+ * @param isFree 1 - cluster was released, 0 - cluster was allocated
+ */
+static void FAT_FreeMapUpdate(uint32_t cluster, uint8_t isFree) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t segment = cluster / FAT_FREE_MAP_CLUSTERS;
+  uint32_t bit = cluster % FAT_FREE_MAP_CLUSTERS;
+
+  if (isFree) {
+    if (part->freeClusters < part->clusterCount) {
+      part->freeClusters++;
+    }
+    if (segment == vol->freeMapSegment) {
+      vol->freeMap[bit / 32] |= 1u << (bit % 32);
+    }
+    if (segment < FAT_FREE_SEGMENTS) {
+      vol->freeMapFull[segment / 32] &= ~(1u << (segment % 32));
+    }
+  } else {
+    // count from FSInfo may be stale, don't wrap around
+    if (part->freeClusters != UINT32_MAX && part->freeClusters) {
+      part->freeClusters--;
+    }
+    if (segment == vol->freeMapSegment) {
+      vol->freeMap[bit / 32] &= ~(1u << (bit % 32));
+    }
+  }
+  part->fsInfoDirty = 1;
+}
+/**
+ * @brief Finds a free cluster.
+ *
+ * @details Searches the free bitmap a word at a time starting at a
+ * given cluster, then the following segments, and wraps around at the
+ * end of the volume. Segments known to be full are skipped, segments
+ * found full are marked in the summary.
+ *
+ * @param start Cluster to start searching from
+ * @return Free cluster or 0 if the volume is full.
+ */
+static uint32_t FAT_FindFreeCluster(uint32_t start) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t lastCluster = part->clusterCount + 1;
+  uint32_t segments = lastCluster / FAT_FREE_MAP_CLUSTERS + 1;
+
+  if (start < 2 || start > lastCluster) {
+    start = 2;
+  }
+
+  uint32_t segment = start / FAT_FREE_MAP_CLUSTERS;
+  uint32_t offset = start % FAT_FREE_MAP_CLUSTERS;
+
+  // one more pass over the first segment for clusters before start
+  for (uint32_t n = 0; n <= segments; n++) {
+    if (!FAT_FreeMapIsFull(segment)) {
+      if (segment != vol->freeMapSegment) {
+        FAT_FreeMapLoad(segment);
+      }
+      for (uint32_t i = offset / 32; i < FAT_FREE_MAP_CLUSTERS / 32; i++) {
+        uint32_t bits = vol->freeMap[i];
+        if (i == offset / 32) {
+          bits &= ~0u << (offset % 32); // skip clusters before start
+        }
+        if (bits) {
+          return segment * FAT_FREE_MAP_CLUSTERS + i * 32 + __builtin_ctz(bits);
+        }
+      }
+      if (!offset && segment < FAT_FREE_SEGMENTS) {
+        vol->freeMapFull[segment / 32] |= 1u << (segment % 32);
+      }
+    }
+    offset = 0;
+    segment = (segment + 1 < segments) ? segment + 1 : 0;
+  }
+
+  part->freeClusters = 0;
+  return 0;
+}
+/**
+ * @brief Finds a run of adjacent free clusters.
+ *
+ * @details Walks the free bitmap from a given cluster to the end
+ * of the volume and then from its start. Whole bitmap words and
+ * full segments are skipped at once.
+ *
+ * @param start Cluster to start searching from
+ * @param count Number of clusters needed
+ * @return First cluster of the run or 0 if there is no such run.
+ */
+static uint32_t FAT_FindFreeRun(uint32_t start, uint32_t count) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t lastCluster = part->clusterCount + 1;
+  uint32_t runStart = 0;
+  uint32_t runLength = 0;
+  uint32_t checked = 0;
+
+  if (start < 2 || start > lastCluster) {
+    start = 2;
+  }
+  uint32_t cluster = start;
+
+  while (checked < part->clusterCount + FAT_FREE_MAP_CLUSTERS) {
+    if (cluster > lastCluster) {
+      // runs don't wrap around
+      cluster = 2;
+      runLength = 0;
+    }
+
+    uint32_t segment = cluster / FAT_FREE_MAP_CLUSTERS;
+    if (FAT_FreeMapIsFull(segment)) {
+      checked += (segment + 1) * FAT_FREE_MAP_CLUSTERS - cluster;
+      cluster = (segment + 1) * FAT_FREE_MAP_CLUSTERS;
+      runLength = 0;
+      continue;
+    }
+    if (segment != vol->freeMapSegment) {
+      FAT_FreeMapLoad(segment);
+    }
+
+    uint32_t bit = cluster % FAT_FREE_MAP_CLUSTERS;
+    uint32_t word = vol->freeMap[bit / 32];
+    uint32_t step = 1;
+
+    if (bit % 32 == 0 && (word == 0 || word == UINT32_MAX)) {
+      // whole word used or free
+      step = 32;
+    } else {
+      word = (word >> (bit % 32)) & 1;
+    }
+
+    if (!word) {
+      runLength = 0;
+    } else {
+      if (!runLength) {
+        runStart = cluster;
+      }
+      runLength += step;
+      if (runLength >= count && runStart + count - 1 <= lastCluster) {
+        return runStart;
+      }
+    }
+    cluster += step;
+    checked += step;
+  }
+  return 0;
+}
+/**
+ * @brief Allocates a cluster and links it at the end of a chain.
+ *
+ * @details The cluster following prevCluster is taken if it's free,
+ * so that a file keeps growing contiguously. Otherwise the search
+ * continues where the last allocation ended (next-fit), which keeps
+ * sequentially written files contiguous too. Both FAT entries are
+ * only modified in the FAT cache.
+ *
+ * @param prevCluster Last cluster of the chain or 0 to start a new chain
+ * @return Allocated cluster or 0 if the volume is full.
+ */
+static uint32_t FAT_AllocCluster(uint32_t prevCluster) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t cluster = 0;
+
+  if (prevCluster >= 2 && prevCluster <= part->clusterCount &&
+      FAT_GetEntryInFAT(prevCluster + 1) == 0) {
+    cluster = prevCluster + 1;
+  } else {
+    cluster = FAT_FindFreeCluster(part->nextFreeCluster);
+  }
+  if (!cluster) {
+    return 0;
+  }
+
+  // terminate the chain first and then link it
+  FAT_SetEntryInFAT(cluster, FAT_LAST_CLUSTER);
+  if (prevCluster >= 2) {
+    FAT_SetEntryInFAT(prevCluster, cluster);
+  }
+  part->nextFreeCluster = cluster + 1;
+  part->fsInfoDirty = 1;
+
+  LOG_TRACE("%s: Allocated cluster %u after %u", __FUNCTION__,
+      (unsigned int)cluster, (unsigned int)prevCluster);
+
+  return cluster;
+}
+/**
+ * @brief Adds a cluster appended to a file to its cluster map.
+ *
+ * @details The cluster either extends the last run or starts a new
+ * one. If the table has no room for another run, the map is dropped
+ * and the file falls back to walking the FAT.
+ *
+ * @param file File
+ * @param cluster Cluster appended to the chain
+ */
+static void FAT_MapAppend(FAT_File* file, uint32_t cluster) {
+
+  uint32_t* map = file->clusterMap;
+
+  if (!map) {
+    return;
+  }
+
+  uint32_t runs = map[0];
+  uint32_t clusters = map[1 + 2*runs];
+
+  // cluster adjacent to the end of the last run
+  if (runs && map[2 + 2*(runs-1)] + clusters - map[1 + 2*(runs-1)] == cluster) {
+    map[1 + 2*runs]++;
+    return;
+  }
+
+  if (4 + 2*runs > file->clusterMapSize) {
+    LOG_WARN("%s: Cluster map full, fast seek disabled", __FUNCTION__);
+    if (file->clusterMapPool != -1) {
+      clusterMapPoolUsed[(int)file->clusterMapPool] = 0;
+    }
+    file->clusterMap = 0;
+    file->clusterMapSize = 0;
+    file->clusterMapPool = -1;
+    file->rdCursor.map = 0;
+    file->wrCursor.map = 0;
+    return;
+  }
+
+  map[1 + 2*runs] = clusters;
+  map[2 + 2*runs] = cluster;
+  map[3 + 2*runs] = clusters + 1;
+  map[0] = runs + 1;
+}
+/**
+ * @brief Appends clusters to a file.
+ *
+ * @details Called when the write iterator reached the end of the
+ * cluster chain. Enough clusters for the given number of sectors
+ * are allocated at once (up to FAT_MAX_TRANSFER sectors), so that
+ * they can be written with one transfer when they are adjacent.
+ * The iterator stays at the end of the previous last cluster and
+ * moves into the new ones with the next FAT_ExtentGet call.
+ *
+ * @param file File
+ * @param ext Write iterator of the file
+ * @param sectors Number of sectors still to be written
+ * @retval 0 At least one cluster appended
+ * @retval -1 Volume full or iterator beyond the end of the chain
+ */
+static int FAT_ExtendFile(FAT_File* file, FAT_Extent* ext, uint32_t sectors) {
+
+  uint32_t sectorsPerCluster = vol->part.sectorsPerCluster;
+  uint32_t prevCluster = 0;
+
+  if (file->firstCluster >= 2) {
+    // iterator has to be at the end of the last cluster
+    if (ext->cluster < 2 || FAT_IS_EOC(ext->cluster) ||
+        ext->sectorOffset != sectorsPerCluster) {
+      return -1;
+    }
+    prevCluster = ext->cluster;
+  }
+
+  if (sectors > FAT_MAX_TRANSFER) {
+    sectors = FAT_MAX_TRANSFER;
+  }
+  uint32_t count = (sectors + sectorsPerCluster - 1) / sectorsPerCluster;
+  uint32_t i;
+
+  FAT_JournalReserve(file);
+
+  for (i = 0; i < count; i++) {
+    // the journal has to describe every cluster allocated
+    if (FAT_JournalFull(file)) {
+      break;
+    }
+    uint32_t cluster = FAT_AllocCluster(prevCluster);
+    if (!cluster) {
+      break;
+    }
+    if (!prevCluster) {
+      // first cluster of an empty file
+      file->firstCluster = cluster;
+      file->contiguous = 1;
+      ext->cluster = cluster;
+      ext->sectorOffset = 0;
+      ext->index = 0;
+      if (file->rdCursor.cluster < 2) {
+        FAT_ExtentSeek(&file->rdCursor, file, file->rdPtr);
+      }
+    } else if (file->contiguous &&
+        prevCluster == file->firstCluster + file->contiguous - 1 &&
+        cluster == prevCluster + 1) {
+      file->contiguous++; // still contiguous
+    }
+    FAT_MapAppend(file, cluster);
+    FAT_JournalAddRun(file, cluster, 1, prevCluster);
+    prevCluster = cluster;
+  }
+  FAT_ExtentSetContiguous(file);
+
+  if (!i) {
+    LOG_WARN("%s: No free clusters", __FUNCTION__);
+    return -1;
+  }
+  return 0;
+}
+/**
+ * @brief Computes the checksum of the journal sector.
+ * @return Sum of all words preceding the checksum
+ */
+static uint32_t FAT_JournalChecksum(void) {
+
+  const uint32_t* words = (const uint32_t*)&vol->journal;
+  uint32_t sum = 0;
+
+  for (uint32_t i = 0; i < sizeof(FAT_Journal) / 4 - 1; i++) {
+    sum += words[i];
+  }
+  return sum;
+}
+/**
+ * @brief Writes the journal to the card if the transaction changed.
+ *
+ * @details Called before any FAT or cached sector is written, so the
+ * card never holds metadata of a transaction it can't roll back.
+ */
+static void FAT_JournalSave(void) {
+
+  if (!vol->journalDirty || !vol->journalSector) {
+    return;
+  }
+  vol->journalDirty = 0;
+  vol->journal.signature = FAT_JOURNAL_SIGNATURE;
+  vol->journal.sequence++;
+  vol->journal.checksum = FAT_JournalChecksum();
+  vol->phyCallbacks.phyWriteSectors((uint8_t*)&vol->journal, vol->journalSector, 1);
+  LOG_TRACE("%s: Journal %u written, %u files", __FUNCTION__,
+      (unsigned int)vol->journal.sequence, (unsigned int)vol->journal.files);
+}
+/**
+ * @brief Adds a file to the open transaction.
+ *
+ * @details Has to be called before the file grows. Its current size,
+ * first cluster and (on the first allocation) last cluster are what
+ * a roll back restores. If the journal is full, the transaction
+ * is committed first.
+ *
+ * @param file File
+ * @return Journal record of the file or 0 if journaling is off.
+ */
+static FAT_JournalFile* FAT_JournalBegin(FAT_File* file) {
+
+  if (!vol->journalSector) {
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < vol->journal.files; i++) {
+    if (vol->journal.file[i].dirSector == file->dirSector &&
+        vol->journal.file[i].dirIndex == file->dirIndex) {
+      return &vol->journal.file[i];
+    }
+  }
+
+  if (vol->journal.files == FAT_JOURNAL_FILES) {
+    FAT_SyncVolume();
+  }
+
+  FAT_JournalFile* record = &vol->journal.file[vol->journal.files++];
+  record->dirSector = file->dirSector;
+  record->dirIndex = file->dirIndex;
+  record->firstCluster = file->firstCluster;
+  record->fileSize = file->fileSize;
+  record->lastCluster = UINT32_MAX;
+  record->runs = 0;
+  vol->journalDirty = 1;
+
+  return record;
+}
+/**
+ * @brief Makes room in the journal for at least one new run of a file.
+ *
+ * @details Commits the transaction if the record of the file is full.
+ *
+ * @param file File about to get new clusters
+ */
+static void FAT_JournalReserve(FAT_File* file) {
+
+  FAT_JournalFile* record = FAT_JournalBegin(file);
+
+  if (record && record->runs == FAT_JOURNAL_RUNS) {
+    FAT_SyncVolume();
+    FAT_JournalBegin(file);
+  }
+}
+/**
+ * @brief Checks whether the journal can't take another run of a file.
+ * @param file File
+ * @retval 1 Record of the file is full
+ * @retval 0 Record has room or journaling is off
+ */
+static int FAT_JournalFull(FAT_File* file) {
+
+  FAT_JournalFile* record = FAT_JournalBegin(file);
+
+  return record && record->runs == FAT_JOURNAL_RUNS;
+}
+/**
+ * @brief Records clusters appended to a file.
+ *
+ * @details The clusters extend the last run of the record if they
+ * follow it. FAT_JournalReserve has to be called first.
+ *
+ * @param file File
+ * @param first First appended cluster
+ * @param count Number of adjacent clusters appended
+ * @param prevCluster Last cluster of the file before the append, 0 if
+ * the file was empty
+ */
+static void FAT_JournalAddRun(FAT_File* file, uint32_t first, uint32_t count,
+    uint32_t prevCluster) {
+
+  FAT_JournalFile* record = FAT_JournalBegin(file);
+
+  if (!record) {
+    return;
+  }
+  if (record->lastCluster == UINT32_MAX) {
+    record->lastCluster = prevCluster;
+  }
+  uint32_t runs = record->runs;
+  if (runs && record->run[runs-1][0] + record->run[runs-1][1] == first) {
+    record->run[runs-1][1] += count;
+  } else {
+    record->run[runs][0] = first;
+    record->run[runs][1] = count;
+    record->runs++;
+  }
+  vol->journalDirty = 1;
+}
+/**
+ * @brief Rolls back the transaction found in the journal at mount.
+ *
+ * @details Directory entries get back their committed size and first
+ * cluster, chains are cut at their committed last cluster and the
+ * appended clusters are freed. Only the sectors holding these entries
+ * are read, so recovery time doesn't depend on the size of the volume.
+ */
+static void FAT_JournalRollBack(void) {
+
+  FAT_PartitionInfo* part = &vol->part;
+
+  for (uint32_t i = 0; i < vol->journal.files && i < FAT_JOURNAL_FILES; i++) {
+    FAT_JournalFile* record = &vol->journal.file[i];
+
+    LOG_WARN("%s: Rolling back file at %u:%u to %u bytes", __FUNCTION__,
+        (unsigned int)record->dirSector, (unsigned int)record->dirIndex,
+        (unsigned int)record->fileSize);
+
+    if (record->dirIndex < 16) {
+      FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)
+          FAT_ReadSector(record->dirSector);
+      dirEntry += record->dirIndex;
+      dirEntry->fileSize = record->fileSize;
+      dirEntry->firstClusterH = record->firstCluster >> 16;
+      dirEntry->firstClusterL = record->firstCluster & 0xffff;
+      FAT_WriteSector(record->dirSector);
+    }
+
+    if (record->lastCluster >= 2 && record->lastCluster <= part->clusterCount + 1) {
+      FAT_SetEntryInFAT(record->lastCluster, FAT_LAST_CLUSTER);
+    }
+    for (uint32_t j = 0; j < record->runs && j < FAT_JOURNAL_RUNS; j++) {
+      for (uint32_t k = 0; k < record->run[j][1]; k++) {
+        uint32_t cluster = record->run[j][0] + k;
+        if (cluster < 2 || cluster > part->clusterCount + 1) {
+          break;
+        }
+        if (FAT_GetEntryInFAT(cluster)) {
+          FAT_SetEntryInFAT(cluster, 0);
+        }
+      }
+    }
+  }
+
+  // FSInfo may hold the count from before or after the transaction
+  part->freeClusters = UINT32_MAX;
+  part->fsInfoDirty = 1;
+}
+/**
+ * @brief Finds the journal and recovers from an interrupted transaction.
+ *
+ * @details The journal is the first sector of FAT_JOURNAL_NAME in the
+ * root directory. A transaction found in it was interrupted by a power
+ * loss, so it's rolled back to the state of the last commit, whether
+ * journaling is on or not. With the FAT_OPT_JOURNAL mount option the
+ * file is created if needed and journaling is turned on: appends
+ * (size, new clusters) become visible on the card atomically at sync,
+ * while the write-back cache keeps working in between. The lookup
+ * doesn't take a file ID, so the journal is found however many files
+ * are opened.
+ *
+ * @retval 0 Journal opened, created or not needed
+ * @retval -1 Error: journaling is requested, but the journal is damaged
+ * or can't be created (no free file ID, directory entry or cluster)
+ */
+static int FAT_JournalOpen(void) {
+
+  FAT_File file;
+  strcpy(file.filename, FAT_JOURNAL_NAME);
+
+  vol->journalSector = 0;
+  vol->journalDirty = 0;
+  memset(&vol->journal, 0, sizeof(FAT_Journal));
+
+  if (FAT_FindFile(&file, vol->part.rootDirCluster) == -1) {
+    if (!(mountOptions & FAT_OPT_JOURNAL)) {
+      return 0;
+    }
+    // one cluster, sized so that nobody takes it for an empty file
+    char name[] = "0:" FAT_JOURNAL_NAME;
+    name[0] += vol - volumes;
+    int id = FAT_NewFile(name);
+    if (id == -2) {
+      LOG_ERROR("%s: No free file ID for the journal", __FUNCTION__);
+      return -1;
+    }
+    if (id == -1) {
+      LOG_ERROR("%s: Can't create journal", __FUNCTION__);
+      return -1;
+    }
+    if (FAT_Preallocate(id, 512) == -1) {
+      LOG_ERROR("%s: No free cluster for the journal", __FUNCTION__);
+      // an empty journal would be taken for a damaged one at next mount
+      FAT_CloseFile(id);
+      FAT_DeleteFile(name);
+      return -1;
+    }
+    FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)
+        FAT_ReadSector(openedFiles[id].dirSector);
+    dirEntry[openedFiles[id].dirIndex].attributes = 0x26; // hidden, system, archive
+    FAT_WriteSector(openedFiles[id].dirSector);
+    openedFiles[id].fileSize = 512;
+    FAT_MarkEntryDirty(id, 0);
+    file = openedFiles[id];
+    FAT_CloseFile(id);
+    vol->journalSector = FAT_Cluster2Sector(file.firstCluster);
+    vol->journalDirty = 1;
+    FAT_JournalSave();
+    LOG_INFO("%s: Journal created at sector %u", __FUNCTION__,
+        (unsigned int)vol->journalSector);
+    return 0;
+  }
+
+  if (file.firstCluster < 2 ||
+      file.firstCluster > vol->part.clusterCount + 1) {
+    LOG_ERROR("%s: Invalid journal", __FUNCTION__);
+    return (mountOptions & FAT_OPT_JOURNAL) ? -1 : 0;
+  }
+
+  vol->journalSector = FAT_Cluster2Sector(file.firstCluster);
+  vol->phyCallbacks.phyReadSectors((uint8_t*)&vol->journal, vol->journalSector, 1);
+
+  if (vol->journal.signature == FAT_JOURNAL_SIGNATURE &&
+      vol->journal.checksum == FAT_JournalChecksum() && vol->journal.files) {
+    FAT_JournalRollBack();
+    // writes the empty journal
+    FAT_SyncVolume();
+  }
+  vol->journal.files = 0;
+
+  if (!(mountOptions & FAT_OPT_JOURNAL)) {
+    vol->journalSector = 0;
+  }
+  return 0;
+}
+/**
+ * @brief Converts cluster number to sector number from start of drive
+ *
+ * @details Two first clusters are reserved (-2 term in the equation).
+ *
+ * @param cluster Cluster number
+ *
+ * @return Sector number counting from the start of the drive.
+ */
+static uint32_t FAT_Cluster2Sector(uint32_t cluster) {
+
+  uint32_t sector = vol->part.dataStartSector
+      + (cluster - 2) * vol->part.sectorsPerCluster;
+
+  return sector;
+}
+/**
+ * @brief Gets FAT entry for given cluster
+ * @param cluster Cluster number
+ * @return FAT entry for given cluster
+ */
+static uint32_t FAT_GetEntryInFAT(uint32_t cluster) {
+
+  // Every entry is 4 bytes long, so there are 128 entries in a sector.
+  // The quotient gives the sector of the entry and the remainder
+  // the number of the 32-bit entry in the sector.
+  uint32_t sector = vol->part.startFatSector +
+      cluster / 128;
+
+  // read sector where FAT entry is at
+  uint32_t entry = FAT_ReadFATSector(sector)[cluster % 128];
+
+  LOG_TRACE("%s: Fat entry for %u is %08x", __FUNCTION__,
+      (unsigned int)cluster, (unsigned int)entry);
+
+  return entry & FAT_ENTRY_MASK;
+}
+/**
+ * @brief Sets FAT entry for given cluster
+ *
+ * @details The entry is modified in the FAT cache and written
+ * to the card when the cache line is written back. The
+ * reserved upper 4 bits of the entry are preserved.
+ *
+ * @param cluster Cluster number
+ * @param value New entry (next cluster or end of chain marker)
  */
-int FAT_ReadFile(int file, uint8_t* data, int count) {
+static void FAT_SetEntryInFAT(uint32_t cluster, uint32_t value) {
 
-  println("%s", __FUNCTION__);
+  uint32_t sector = vol->part.startFatSector +
+      cluster / 128;
 
-  // if incorrect file ID
-  if (file >= MAX_OPENED_FILES) {
-    println("Maximum number of files open");
-    return -1;
-  }
+  uint32_t* entries = FAT_ReadFATSector(sector);
+  FAT_FATCacheLine* line = vol->fatCacheLast; // line holding the sector
 
-  // File not opened
-  if (openedFiles[file].id == -1) {
-    println("File not open");
-    return -1; // EOF for not open file
-  }
-  // We have already reached EOF
-  if (openedFiles[file].rdPtr >= openedFiles[file].fileSize) {
-    println("EOF reached");
-    return -1;
+  uint32_t wasFree = !(entries[cluster % 128] & FAT_ENTRY_MASK);
+  if (wasFree != !(value & FAT_ENTRY_MASK)) {
+    FAT_FreeMapUpdate(cluster, !wasFree);
   }
 
-  int len = 0; // number of bytes read
-
-  // jump to sector where read pointer is at (counting from first sector)
-  // each sector is 512 bytes long
-  uint32_t sectorOffset = openedFiles[file].rdPtr / 512;
+  entries[cluster % 128] = (entries[cluster % 128] & ~FAT_ENTRY_MASK) |
+      (value & FAT_ENTRY_MASK);
 
-  // which cluster from start cluster is the sector at
-  uint32_t clusterOffset = sectorOffset/
-      mountedDisks[0].partitionInfo[0].sectorsPerCluster;
-  // sector to read in the cluster
-  sectorOffset = sectorOffset %
-      mountedDisks[0].partitionInfo[0].sectorsPerCluster;
+  FAT_FATCacheMarkDirty(line, sector);
 
-  // find the cluster number where the data is at
-  uint32_t baseCluster = 0;
-  FAT_GetCluster(openedFiles[file].firstCluster, clusterOffset,
-      &baseCluster);
-  uint32_t baseSector = FAT_Cluster2Sector(baseCluster);
-
-  // add number of sectors in the cluster where data is at
-  baseSector += sectorOffset;
+  LOG_TRACE("%s: Fat entry for %u set to %08x", __FUNCTION__,
+      (unsigned int)cluster, (unsigned int)value);
+}
+/**
+ * @brief Links a run of adjacent clusters into a chain.
+ *
+ * @details Every cluster points at the next one and the last one
+ * is the end of the chain. Entries are modified a FAT sector at a
+ * time in the FAT cache.
+ *
+ * @param first First cluster of the run
+ * @param count Number of clusters in the run
+ */
+static void FAT_LinkRun(uint32_t first, uint32_t count) {
 
-  // read data sector
-  FAT_ReadSector(baseSector);
+  uint32_t startFatSector = vol->part.startFatSector;
+  uint32_t cluster = first;
+  uint32_t end = first + count;
 
-  // start getting data from read pointer (in the current sector)
-  uint8_t* ptr = buf + openedFiles[file].rdPtr % 512;
+  while (cluster < end) {
+    uint32_t sector = startFatSector + cluster / 128;
+    uint32_t* entries = FAT_ReadFATSector(sector);
+    FAT_FATCacheLine* line = vol->fatCacheLast; // line holding the sector
 
-  println("%s: reading data", __FUNCTION__);
-  for (int i = 0; i < count; i++) {
+    do {
+      uint32_t value = (cluster + 1 < end) ? cluster + 1 : FAT_LAST_CLUSTER;
+      if (!(entries[cluster % 128] & FAT_ENTRY_MASK)) {
+        FAT_FreeMapUpdate(cluster, 0);
+      }
+      entries[cluster % 128] = (entries[cluster % 128] & ~FAT_ENTRY_MASK) | value;
+      cluster++;
+    } while (cluster < end && cluster % 128);
 
-    data[i] = *ptr++;
-    openedFiles[file].rdPtr++;
-    len++;
-    // check if EOF reached
-    if (openedFiles[file].rdPtr >= openedFiles[file].fileSize) {
-      println("%s: EOF reached", __FUNCTION__);
-      break;
-    }
-    // if sector boundary reached
-    if (openedFiles[file].rdPtr % 512 == 0) {
-      println("%s: read new sector", __FUNCTION__);
-      // increment sector counter
-      sectorOffset++;
-      // which sector in cluster is it
-      sectorOffset = sectorOffset %
-          mountedDisks[0].partitionInfo[0].sectorsPerCluster;
-
-      // if first sector, then read new cluster
-      if (sectorOffset == 0) {
-        println("%s: jump to next cluster", __FUNCTION__);
-        // change cluster to next
-        FAT_GetCluster(baseCluster, 1, &baseCluster);
+    FAT_FATCacheMarkDirty(line, sector);
+  }
+}
+/**
+ * @brief Releases a cluster chain.
+ *
+ * @details Entries are cleared a FAT sector at a time in the FAT
+ * cache and the clusters are handed back to the free space bitmap.
+ * The walk stops at an entry which is already free, so a damaged
+ * chain can't free clusters twice.
+ *
+ * @param cluster First cluster of the chain
+ */
+static void FAT_FreeChain(uint32_t cluster) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t count = 0;
+
+  while (cluster >= 2 && cluster <= part->clusterCount + 1) {
+    uint32_t sector = part->startFatSector + cluster / 128;
+    uint32_t* entries = FAT_ReadFATSector(sector);
+    FAT_FATCacheLine* line = vol->fatCacheLast; // line holding the sector
+    uint32_t base = cluster - cluster % 128;
+
+    // follow the chain while it stays in this FAT sector
+    while (cluster - base < 128 && cluster <= part->clusterCount + 1) {
+      uint32_t next = entries[cluster % 128] & FAT_ENTRY_MASK;
+      if (!next) {
+        cluster = 0;
+        break;
       }
-      baseSector = FAT_Cluster2Sector(baseCluster) + sectorOffset;
-      FAT_ReadSector(baseSector);
-      ptr = buf;
+      entries[cluster % 128] &= ~FAT_ENTRY_MASK;
+      FAT_FreeMapUpdate(cluster, 1);
+      count++;
+      cluster = next;
     }
+
+    FAT_FATCacheMarkDirty(line, sector);
   }
 
-  return len;
+  LOG_TRACE("%s: Released %u clusters", __FUNCTION__, (unsigned int)count);
 }
 /**
- * @brief Writes data to a file
- * @param file ID of file, to which we write data.
- * @param data Data to write
- * @param count Number of bytes to write
- * @return Number of bytes written.
- * TODO Make this cross sector and cluster boundaries
- * FIXME For now we can write only up to EOF
+ * @brief Gets the sector holding an entry of a directory.
+ *
+ * @details The walk remembers the cluster it's at, so visiting the
+ * entries in order reads every FAT entry of the directory only once.
+ *
+ * @param walk Position in the directory, index set to UINT32_MAX
+ * before the first call
+ * @param slot Number of the entry in the directory
+ * @return Sector holding the entry or 0 if the directory is shorter.
  */
-int FAT_WriteFile(int file, const uint8_t* data, int count) {
+static uint32_t FAT_DirSector(FAT_DirWalk* walk, uint32_t slot) {
 
-  println("%s", __FUNCTION__);
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t index = slot / 16 / part->sectorsPerCluster;
 
-  // if incorrect file ID
-  if (file >= MAX_OPENED_FILES) {
-    println("Maximum number of files open");
-    return -1;
+  if (walk->index > index) {
+    walk->cluster = walk->first;
+    walk->index = 0;
   }
-
-  // File not opened
-  if (openedFiles[file].id == -1) {
-    println("File not open");
-    return -1; // EOF for not open file
+  while (walk->index < index) {
+    if (walk->cluster < 2 || walk->cluster > part->clusterCount + 1) {
+      return 0;
+    }
+    walk->cluster = FAT_GetEntryInFAT(walk->cluster);
+    walk->index++;
   }
-  // We have already reached EOF
-  // TODO Make this cross EOF - adding more data - change file size in root dir
-  if (openedFiles[file].wrPtr >= openedFiles[file].fileSize) {
-    println("%s: EOF reached", __FUNCTION__);
-
-    // TODO Zero out the bytes between wrPtr and filesize
-    // TODO If new cluster we need to add cluster info in FAT
+  if (walk->cluster < 2 || walk->cluster > part->clusterCount + 1) {
+    return 0; // end of chain
   }
+  return FAT_Cluster2Sector(walk->cluster) + slot / 16 % part->sectorsPerCluster;
+}
+/**
+ * @brief Gets the number of a directory entry in its directory.
+ * @param dirCluster First cluster of the directory
+ * @param sector Sector holding the entry
+ * @param index Number of the entry in the sector
+ * @return Number of the entry or UINT32_MAX if the sector isn't
+ * in the directory.
+ */
+static uint32_t FAT_DirSlot(uint32_t dirCluster, uint32_t sector, uint32_t index) {
 
-  int len = 0; // number of bytes written
+  FAT_PartitionInfo* part = &vol->part;
+  uint32_t cluster = (sector - part->dataStartSector) / part->sectorsPerCluster + 2;
+  uint32_t slots = 0;
 
-  // jump to sector where write pointer is at (counting from first sector)
-  // each sector is 512 bytes long
-  uint32_t sectorOffset = openedFiles[file].wrPtr / 512;
+  while (dirCluster != cluster) {
+    if (dirCluster < 2 || dirCluster > part->clusterCount + 1 ||
+        slots >= FAT_DIR_MAX_ENTRIES) {
+      return UINT32_MAX;
+    }
+    dirCluster = FAT_GetEntryInFAT(dirCluster);
+    slots += part->sectorsPerCluster * 16;
+  }
+  return slots + (sector - FAT_Cluster2Sector(cluster)) * 16 + index;
+}
+/**
+ * @brief Finds a free entry in a directory.
+ *
+ * @details In an indexed directory the search starts at the free slot
+ * hint and moves the hint past the entries found in use, so creating
+ * many files doesn't read the directory from the start every time.
+ * If the directory is full, a cluster is appended to it. The new
+ * cluster is zero filled on the card before it's linked, so a power
+ * loss can't leave stale data in the directory.
+ *
+ * @param dirCluster First cluster of the directory
+ * @param sector Sector holding the free entry (function writes this)
+ * @param index Number of the entry in the sector (function writes this)
+ * @retval 0 Free entry found
+ * @retval -1 Directory full and can't be extended
+ */
+static int FAT_FindFreeSlot(uint32_t dirCluster, uint32_t* sector,
+    uint32_t* index) {
+
+  FAT_PartitionInfo* part = &vol->part;
+  FAT_DirIndex* dirIndex = FAT_DirIndexGet(dirCluster);
+  FAT_DirWalk walk;
+  walk.first = dirCluster;
+  walk.index = UINT32_MAX;
+
+  uint32_t slot;
+  for (slot = dirIndex ? dirIndex->freeSlot : 0; slot < FAT_DIR_MAX_ENTRIES; slot++) {
+    *sector = FAT_DirSector(&walk, slot);
+    if (!*sector) {
+      break; // end of directory
+    }
+    *index = slot % 16;
+    FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(*sector);
+    dirEntry += *index;
+    if (dirIndex) {
+      dirIndex->freeSlot = slot + 1;
+    }
+    if (dirEntry->filename[0] == 0x00 || dirEntry->filename[0] == 0xe5) {
+      return 0;
+    }
+  }
 
-  // which cluster from start cluster is the sector at
-  uint32_t clusterOffset = sectorOffset/
-      mountedDisks[0].partitionInfo[0].sectorsPerCluster;
-  // sector to write in the cluster
-  sectorOffset = sectorOffset %
-      mountedDisks[0].partitionInfo[0].sectorsPerCluster;
+  // only whole clusters are walked, the walk is at the last one
+  if (slot >= FAT_DIR_MAX_ENTRIES || walk.cluster < 2 ||
+      !FAT_IS_EOC(walk.cluster)) {
+    return -1;
+  }
+  // the walk went past the end, step back to the last cluster
+  walk.index = UINT32_MAX;
+  FAT_DirSector(&walk, slot - 1);
+  uint32_t cluster = FAT_AllocCluster(walk.cluster);
+  if (!cluster) {
+    return -1;
+  }
 
-  // find the cluster number where the data is at
-  uint32_t baseCluster = 0;
-  FAT_GetCluster(openedFiles[file].firstCluster, clusterOffset,
-      &baseCluster);
-  uint32_t baseSector = FAT_Cluster2Sector(baseCluster);
+  *sector = FAT_Cluster2Sector(cluster);
+  *index = 0;
+  // the cluster may have been released with its data still cached,
+  // getting a sector without loading it zero fills the cached copy too
+  for (uint32_t i = 0; i < part->sectorsPerCluster; i++) {
+    FAT_GetSector(*sector + i, 0);
+    FAT_WriteSector(*sector + i);
+    FAT_CacheWriteBack(FAT_CacheFind(*sector + i), 0);
+  }
+  LOG_INFO("%s: Directory extended with cluster %u", __FUNCTION__,
+      (unsigned int)cluster);
+  return 0;
+}
+/**
+ * @brief Hashes an 8.3 name for the directory name index.
+ * @param name 11 characters of name and extension
+ * @return Hash of the name
+ */
+static uint16_t FAT_DirIndexHash(const char* name) {
 
-  // add number of sectors in the cluster where data is at
-  baseSector += sectorOffset;
+  // FNV-1a folded to 16 bits
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 11; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return (hash >> 16) ^ (hash & 0xffff);
+}
+/**
+ * @brief Finds the name index of a directory.
+ * @param cluster First cluster of the directory
+ * @return Index of the directory or 0 if it isn't indexed.
+ */
+static FAT_DirIndex* FAT_DirIndexGet(uint32_t cluster) {
 
-  // read data sector
-  FAT_ReadSector(baseSector);
+  for (int i = 0; i < FAT_DIR_INDEXES; i++) {
+    if (vol->dirIndexes[i].cluster == cluster) {
+      return &vol->dirIndexes[i];
+    }
+  }
+  return 0;
+}
+/**
+ * @brief Adds a short entry to a directory name index.
+ * @param dirIndex Index of the directory holding the entry, 0 if the
+ * directory isn't indexed
+ * @param name 11 characters of name and extension
+ * @param sector Sector holding the entry
+ * @param index Number of the entry in the sector
+ * @retval 0 Entry added
+ * @retval -1 Index full
+ */
+static int FAT_DirIndexAdd(FAT_DirIndex* dirIndex, const char* name,
+    uint32_t sector, uint32_t index) {
 
-  // start writing data from write pointer (in the current sector)
-  uint8_t* ptr = buf + openedFiles[file].wrPtr % 512;
+  if (!dirIndex || !dirIndex->valid) {
+    return 0; // nothing to keep coherent
+  }
 
-  println("%s: writing data", __FUNCTION__);
-  for (int i = 0; i < count; i++) {
+  uint16_t hash = FAT_DirIndexHash(name);
+  uint32_t slot = hash & (FAT_DIR_INDEX_SLOTS - 1);
 
-    *ptr++ = data[i];
-    openedFiles[file].wrPtr++;
-    len++;
+  // a removed entry's slot can be reused, it's still counted as used
+  while (dirIndex->slots[slot].sector && dirIndex->slots[slot].sector != UINT32_MAX) {
+    slot = (slot + 1) & (FAT_DIR_INDEX_SLOTS - 1);
+  }
+  if (!dirIndex->slots[slot].sector) {
+    if (dirIndex->used >= FAT_DIR_INDEX_SLOTS / 4 * 3) {
+      return -1;
+    }
+    dirIndex->used++;
+  }
 
-    // if sector boundary reached
-    if (openedFiles[file].wrPtr % 512 == 0) {
-      println("%s: new sector", __FUNCTION__);
-      FAT_WriteSector(baseSector); // save data
-//      FAT_UpdateRootEntry(file);
-      // increment sector counter
-      sectorOffset++;
-      // which sector in cluster is it
-      sectorOffset = sectorOffset %
-          mountedDisks[0].partitionInfo[0].sectorsPerCluster;
-
-      // if first sector, then read new cluster
-      if (sectorOffset == 0) {
-        println("%s: jump to next cluster", __FUNCTION__);
-
-        if (openedFiles[file].wrPtr >= openedFiles[file].fileSize) {
-          // TODO If new cluster then update FAT
-          //        FAT_UpdateCluster();
-        }
+  dirIndex->slots[slot].sector = sector;
+  dirIndex->slots[slot].hash = hash;
+  dirIndex->slots[slot].index = index;
+  return 0;
+}
+/**
+ * @brief Removes a short entry from a directory name index.
+ * @param dirIndex Index of the directory holding the entry, 0 if the
+ * directory isn't indexed
+ * @param name 11 characters of name and extension
+ * @param sector Sector holding the entry
+ * @param index Number of the entry in the sector
+ */
+static void FAT_DirIndexRemove(FAT_DirIndex* dirIndex, const char* name,
+    uint32_t sector, uint32_t index) {
 
-        // change cluster to next
-        FAT_GetCluster(baseCluster, 1, &baseCluster);
+  if (!dirIndex || !dirIndex->valid) {
+    return;
+  }
 
+  uint32_t slot = FAT_DirIndexHash(name) & (FAT_DIR_INDEX_SLOTS - 1);
+
+  while (dirIndex->slots[slot].sector) {
+    if (dirIndex->slots[slot].sector == sector && dirIndex->slots[slot].index == index) {
+      // searches stop at empty slots, so the slot can be emptied
+      // only if the following one is empty
+      if (!dirIndex->slots[(slot + 1) & (FAT_DIR_INDEX_SLOTS - 1)].sector) {
+        dirIndex->slots[slot].sector = 0;
+        dirIndex->used--;
+      } else {
+        dirIndex->slots[slot].sector = UINT32_MAX;
       }
-      baseSector = FAT_Cluster2Sector(baseCluster) + sectorOffset;
-      FAT_ReadSector(baseSector);
-      ptr = buf;
-    }
-
-    // check if EOF reached and update file size
-    if (openedFiles[file].wrPtr >= openedFiles[file].fileSize) {
-      // if writing to end of file - increment filesize
-      openedFiles[file].fileSize = openedFiles[file].wrPtr;
+      return;
     }
+    slot = (slot + 1) & (FAT_DIR_INDEX_SLOTS - 1);
   }
-
-  FAT_WriteSector(baseSector); // save data
-  FAT_UpdateRootEntry(file);
-  return len;
-
 }
 /**
- * @brief Updates the root directory entry of a given file.
+ * @brief Builds the name index of a directory.
  *
- * @details This function is called after a write to the file
- * in order to update the timestamp and the file length if
- * necessary.
+ * @details The least recently used index is replaced. Reads all
+ * entries of the directory. If they don't fit in the index, the
+ * directory is marked to be searched linearly.
  *
- * @param file File ID
+ * @param cluster First cluster of the directory
+ * @return Index of the directory
  */
-static void FAT_UpdateRootEntry(int file) {
-
-  // cluster of root dir
-  uint32_t currentCluster = mountedDisks[0].partitionInfo[0].rootDirCluster;
-
-  // sector where root dir is at
-  uint32_t sector = FAT_Cluster2Sector(currentCluster);
+static FAT_DirIndex* FAT_DirIndexBuild(uint32_t cluster) {
 
-  // every root dir entry is 32 bytes
-  // add sector offset of entry
-  sector += openedFiles[file].rootDirEntry * sizeof(FAT_RootDirEntry) / 512;
-
-  // read sector where entry is at
+  FAT_DirIndex* dirIndex = &vol->dirIndexes[0];
+  for (int i = 1; i < FAT_DIR_INDEXES; i++) {
+    if (vol->dirIndexes[i].lastUsed < dirIndex->lastUsed) {
+      dirIndex = &vol->dirIndexes[i];
+    }
+  }
 
-  FAT_ReadSector(sector);
-  println("%s: Read sector %u", __FUNCTION__, (unsigned int)sector);
+  FAT_DirWalk walk;
+  walk.first = cluster;
+  walk.index = UINT32_MAX;
 
-  // point to entry in the current sector
-//  uint8_t* ptr = buf;
-//  ptr += (openedFiles[file].rootDirEntry * sizeof(FAT_RootDirEntry)) % 512;
+  memset(dirIndex->slots, 0, sizeof(dirIndex->slots));
+  dirIndex->cluster = cluster;
+  dirIndex->valid = 1;
+  dirIndex->used = 0;
+  dirIndex->freeSlot = 0;
 
-  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*) buf;
-  println("%s: Dir entry %u", __FUNCTION__,
-      (unsigned int)openedFiles[file].rootDirEntry);
-  dirEntry += openedFiles[file].rootDirEntry;
+  for (uint32_t slot = 0; slot < FAT_DIR_MAX_ENTRIES; slot++) {
+    uint32_t sector = FAT_DirSector(&walk, slot);
+    if (!sector) {
+      break; // end of directory
+    }
+    FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(sector);
+    dirEntry += slot % 16;
 
-  char filename[12];
-  char* namePtr = (char*)dirEntry->filename;
-  // copy filename from directory entry
-  for (int k = 0; k < 11; k++) {
-    filename[k] = *namePtr++;
+    if (dirEntry->filename[0] == 0x00) {
+      break; // last entry
+    }
+    if (dirEntry->filename[0] == 0xe5) {
+      continue;
+    }
+    // entries are scanned in order, so the free slot
+    // hint can be moved past the ones in use
+    if (slot == dirIndex->freeSlot) {
+      dirIndex->freeSlot = slot + 1;
+    }
+    if (dirEntry->attributes == 0x0f) {
+      continue;
+    }
+    if (FAT_DirIndexAdd(dirIndex, (char*)dirEntry->filename, sector, slot % 16) == -1) {
+      LOG_WARN("%s: Too many entries, directory isn't indexed", __FUNCTION__);
+      dirIndex->valid = 0;
+      break;
+    }
   }
-  filename[11] = 0; // end string
-  dirEntry->fileSize = openedFiles[file].fileSize;
-
-  println("%s: Updating root entry for file: %s, size %u", __FUNCTION__,
-      filename, (unsigned int)openedFiles[file].fileSize);
 
-  FAT_WriteSector(sector);
+  LOG_TRACE("%s: Indexed %u entries", __FUNCTION__, (unsigned int)dirIndex->used);
+  return dirIndex;
 }
 /**
- * @brief Gets number of cluster clusterOffset in a file
+ * @brief Looks up a short entry in a directory name index.
+ * @param dirIndex Index of the directory
+ * @param name 11 characters of name and extension
+ * @param sector Sector holding the entry (function writes this)
+ * @param index Number of the entry in the sector (function writes this)
+ * @retval 0 Entry found
+ * @retval -1 No entry with this name
+ */
+static int FAT_DirIndexFind(FAT_DirIndex* dirIndex, const char* name,
+    uint32_t* sector, uint32_t* index) {
+
+  uint16_t hash = FAT_DirIndexHash(name);
+  uint32_t slot = hash & (FAT_DIR_INDEX_SLOTS - 1);
+  FAT_DirIndexSlot* slots = dirIndex->slots;
+
+  for (uint32_t i = 0; i < FAT_DIR_INDEX_SLOTS && slots[slot].sector; i++) {
+    if (slots[slot].sector != UINT32_MAX && slots[slot].hash == hash) {
+      FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)
+          FAT_ReadSector(slots[slot].sector);
+      if (!memcmp(dirEntry[slots[slot].index].filename, name, 11)) {
+        *sector = slots[slot].sector;
+        *index = slots[slot].index;
+        return 0;
+      }
+    }
+    slot = (slot + 1) & (FAT_DIR_INDEX_SLOTS - 1);
+  }
+  return -1;
+}
+/**
+ * @brief Searches a directory entry by entry.
  *
- * @details
+ * @details Used for directories with too many entries for the index.
  *
- * @param firstCluster First cluster of file
- * @param clusterOffset Cluster from start of file we want to find
- * @param clusterNumber The number of the searched cluster (function writes this)
- * @return Cluster from start of file we really found
+ * @param cluster First cluster of the directory
+ * @param name 11 characters of name and extension
+ * @param sector Sector holding the entry (function writes this)
+ * @param index Number of the entry in the sector (function writes this)
+ * @retval 0 Entry found
+ * @retval -1 No entry with this name
  */
-static int FAT_GetCluster(uint32_t firstCluster, uint32_t clusterOffset,
-    uint32_t* clusterNumber) {
+static int FAT_DirScan(uint32_t cluster, const char* name, uint32_t* sector,
+    uint32_t* index) {
 
-  uint32_t entry = firstCluster;
-  int i;
+  FAT_DirWalk walk;
+  walk.first = cluster;
+  walk.index = UINT32_MAX;
 
-  for (i = 0; i < clusterOffset; i++) {
-    entry = FAT_GetEntryInFAT(entry);
-    // last cluster reached before we reached clusterOffset
-    if (entry == 0xFFFFFFFF) {
-      *clusterNumber = entry; // return the entry
-      return i;
+  for (uint32_t slot = 0; slot < FAT_DIR_MAX_ENTRIES; slot++) {
+    *sector = FAT_DirSector(&walk, slot);
+    if (!*sector) {
+      break; // end of directory
     }
-  }
+    *index = slot % 16;
+    FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(*sector);
+    dirEntry += *index;
 
-  *clusterNumber = entry; // return the entry
-  return clusterOffset;
+    if (dirEntry->filename[0] == 0x00) {
+      break; // last entry
+    }
+    if (dirEntry->filename[0] != 0xe5 && dirEntry->attributes != 0x0f &&
+        !memcmp(dirEntry->filename, name, 11)) {
+      return 0;
+    }
+  }
+  return -1;
 }
 /**
- * @brief Converts cluster number to sector number from start of drive
- *
- * @details Two first clusters are reserved (-2 term in the equation).
+ * @brief Finds an entry in a directory.
  *
- * @param cluster Cluster number
+ * @details FAT_DIR_INDEXES directories are indexed at a time. The
+ * index of a directory is built by the first search in it, in place
+ * of the least recently used one. Later searches read only the
+ * sector holding the entry.
  *
- * @return Sector number counting from the start of the drive.
+ * @param dirCluster First cluster of the directory
+ * @param name 11 characters of name and extension
+ * @param sector Sector holding the entry (function writes this)
+ * @param index Number of the entry in the sector (function writes this)
+ * @retval 0 Entry found
+ * @retval -1 No entry with this name
  */
-static uint32_t FAT_Cluster2Sector(uint32_t cluster) {
+static int FAT_DirLookup(uint32_t dirCluster, const char* name,
+    uint32_t* sector, uint32_t* index) {
 
-  uint32_t sector = mountedDisks[0].partitionInfo[0].dataStartSector
-      + (cluster - 2) * mountedDisks[0].partitionInfo[0].sectorsPerCluster;
+  FAT_DirIndex* dirIndex = FAT_DirIndexGet(dirCluster);
 
-  return sector;
+  if (!dirIndex) {
+    dirIndex = FAT_DirIndexBuild(dirCluster);
+  }
+  dirIndex->lastUsed = ++vol->dirIndexStamp;
+
+  if (dirIndex->valid) {
+    return FAT_DirIndexFind(dirIndex, name, sector, index);
+  }
+  return FAT_DirScan(dirCluster, name, sector, index);
 }
 /**
- * @brief Gets FAT entry for given cluster
- * @param cluster Cluster number
- * @return FAT entry for given cluster
+ * @brief Converts a path component to an 8.3 directory entry name.
+ *
+ * @details "data.bin" becomes "DATA    BIN". A component of 11
+ * characters without a dot is taken as it is, so raw names such as
+ * "LOG00001BIN" keep working. Names with characters not allowed in
+ * 8.3 names (control characters and " * + , / : ; < = > ? [ \ ] |)
+ * are rejected, so such files can't be created.
+ *
+ * @param path Path component
+ * @param length Length of the component
+ * @param name 11 characters of name and extension, zero ended
+ * (function writes this)
+ * @retval 0 Name converted
+ * @retval -1 Not a valid 8.3 name
  */
-static uint32_t FAT_GetEntryInFAT(uint32_t cluster) {
-
-  // Calculate the sector where the FAT entry for the cluster is located at.
-  // Every entry is 4 bytes long. We divide the byte number where the entry
-  // starts (cluster*4) by the number of bytes per sector, which gives
-  // the sector number of the entry
-  uint32_t sector = mountedDisks[0].partitionInfo[0].startFatSector +
-      cluster*4/mountedDisks[0].partitionInfo[0].bytesPerSector;
-
-  println("%s: FAT entry is at sector %d", __FUNCTION__, (unsigned int)sector);
-
-//  uint8_t buf[512]; // buffer for sector data
-
-  // read sector where FAT entry is at
-//  phyCallbacks.phyReadSectors(buf, sector, 1);
-  FAT_ReadSector(sector);
+static int FAT_ShortName(const char* path, uint32_t length, char* name) {
+
+  memset(name, ' ', 11);
+  name[11] = 0;
+
+  if (length == 11 && !memchr(path, '.', 11)) {
+    memcpy(name, path, 11);
+  } else if ((length == 1 || length == 2) && !strncmp(path, "..", length)) {
+    memcpy(name, path, length); // the "." and ".." entries
+  } else {
+    uint32_t pos = 0;
+    uint32_t limit = 8;
+    for (uint32_t i = 0; i < length; i++) {
+      if (path[i] == '.' && limit == 8 && i) {
+        pos = 8; // extension follows
+        limit = 11;
+        continue;
+      }
+      if (pos == limit || path[i] == '.' || path[i] == ' ') {
+        return -1;
+      }
+      char c = path[i];
+      if (c >= 'a' && c <= 'z') {
+        c -= 'a' - 'A';
+      }
+      name[pos++] = c;
+    }
+  }
 
-  // the byte number of the entry in the given sector is the remainder
-  // of the previous calculation
-  uint8_t offset = (cluster*4) % mountedDisks[0].partitionInfo[0].bytesPerSector;
+  if (name[0] == ' ' || (uint8_t)name[0] == 0xe5) {
+    return -1;
+  }
+  for (int i = 0; i < 11; i++) {
+    if ((uint8_t)name[i] < 0x20 || strchr("\"*+,/:;<=>?[\\]|", name[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+/**
+ * @brief Computes the checksum of an 8.3 name stored in long name entries.
+ * @param name 11 characters of name and extension
+ * @return Checksum
+ */
+static uint8_t FAT_LongNameChecksum(const uint8_t* name) {
 
-  // the 4-byte entry is at offset
-  uint32_t* ret = (uint32_t*)(buf+offset);
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  }
+  return sum;
+}
+/**
+ * @brief Compares the characters of a long name entry with a name.
+ *
+ * @details Letters are compared without case. Characters beyond the
+ * end of the name have to be the terminating 0x0000, padding after
+ * it isn't checked.
+ *
+ * @param entry Long name entry
+ * @param longName Name
+ * @param length Length of the name
+ * @return 1 if the part of the name stored in the entry matches, 0 if not.
+ */
+static int FAT_MatchLongEntry(const FAT_LongDirEntry* entry,
+    const char* longName, uint32_t length) {
 
-  println("%s: Fat entry is %08x", __FUNCTION__, (unsigned int)*ret);
+  uint32_t pos = ((entry->order & 0x3f) - 1) * 13;
 
-  return *ret;
+  for (int i = 0; i < 13 && pos <= length; i++, pos++) {
+    uint16_t c = i < 5 ? entry->name1[i] : i < 11 ? entry->name2[i-5] :
+        entry->name3[i-11];
+    if (pos == length) {
+      return c == 0x0000;
+    }
+    uint16_t q = (uint8_t)longName[pos];
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    }
+    if (q >= 'a' && q <= 'z') {
+      q -= 'a' - 'A';
+    }
+    if (c != q) {
+      return 0;
+    }
+  }
+  return 1;
 }
 /**
- * @brief Finds a given file in a directory.
- * @param file Name of the file
- * @return ID of file or -1 if not found.
- * TODO Search for files also in subdirectories of the root directory.
- */
-static int FAT_FindFile(FAT_File* file) {
-
-  println("%s: Searching for file %s", __FUNCTION__, file->filename);
-
-  uint32_t i = 0, j = 0, k = 0;
-
-  FAT_RootDirEntry* dirEntry = 0; // the directory entry
-  // current cluster of root dir
-  uint32_t currentCluster = mountedDisks[0].partitionInfo[0].rootDirCluster;
-  // current sector of root dir
-  uint32_t currentSector;
-
-  char* ptr; // for copying filename
-  char filename[12];
-
-  // do until file is found or we reach last entry in the root directory
-  while(1) {
-
-    // there are 16 entries per sector
-    // Read new sector every 16 entries
-    if ((i%16) == 0) {
-      println("%s: read new sector", __FUNCTION__);
-      // TODO Also change cluster
-      // if whole cluster read - find next cluster
-//      if ((i%mountedDisks[0].partitionInfo[0].sectorsPerCluster) == 0) {
-//        if (i != 0) { // for i == 0 we take first cluster of root dir from boot sector
-//          // for other values search the FAT for next cluster
-//
-//          // new cluster number is in the entry for the current cluster
-//          currentCluster = FAT_GetEntryInFAT(currentCluster);
-//          // if last cluster then stop
-//          if (currentCluster == FAT_LAST_CLUSTER) {
-//            println("Last cluster reached. File not found");
-//            return 1;
-//          }
-//        }
-//        j = 0; // zero out sector counter at every new cluster
-//      }
-
-      // currently read sector is based on the current cluster
-      // and the counter j, which updates every 16 entries
-      currentSector = FAT_Cluster2Sector(currentCluster) + j;
-      // read new sector every 16 entries
-      FAT_ReadSector(currentSector);
-
-      // FIXME This may be needed for terminal
-//      TIMER_Delay(1000);
-
-      // first entry in buffer for new sector
-      dirEntry = (FAT_RootDirEntry*)buf;
-      // go to next sector
-      j++;
-    }
-
-//    println("Comparing file %u", (unsigned int)i);
-    i++; // update counter to next entry.
+ * @brief Finds an entry in a directory by its long name.
+ *
+ * @details Long name entries are matched against the name one at a
+ * time as the directory is read, no long name is assembled. The entries
+ * hold the name from its end, so a name of a different length is
+ * rejected by the order of the first entry and most other names by its
+ * characters. The remaining entries have to follow in order with the
+ * same checksum, which has to be the checksum of the short entry
+ * after them. Orphaned long entries left by other systems never match.
+ *
+ * @param dirCluster First cluster of the directory
+ * @param longName Long name
+ * @param length Length of the long name
+ * @param name 8.3 name of the entry, zero ended (function writes this)
+ * @param sector Sector holding the short entry (function writes this)
+ * @param index Number of the entry in the sector (function writes this)
+ * @retval 0 Entry found
+ * @retval -1 No entry with this long name
+ */
+static int FAT_FindLongName(uint32_t dirCluster, const char* longName,
+    uint32_t length, char* name, uint32_t* sector, uint32_t* index) {
+
+  uint32_t entries = (length + 12) / 13; // long entries holding the name
+  uint8_t matching = 0;  // all long entries so far matched
+  uint32_t expected = 0; // order of the next long entry
+  uint8_t checksum = 0;
+  FAT_DirWalk walk;
+  walk.first = dirCluster;
+  walk.index = UINT32_MAX;
+
+  if (!length || length > 255) {
+    return -1;
+  }
 
-    if (dirEntry->filename[0] == 0x00) {
-      // last root dir entry
-      println("%s: Last entry reached. File not found", __FUNCTION__);
-      return -1;
+  for (uint32_t slot = 0; slot < FAT_DIR_MAX_ENTRIES; slot++) {
+    *sector = FAT_DirSector(&walk, slot);
+    if (!*sector) {
+      break; // end of directory
     }
+    *index = slot % 16;
+    FAT_LongDirEntry* entry = (FAT_LongDirEntry*)FAT_ReadSector(*sector);
+    entry += *index;
 
-    if (dirEntry->filename[0] == 0xe5) {
-//      println("Empty file");
-      dirEntry++;
-      continue;
+    if (entry->order == 0x00) {
+      break; // last entry
     }
-    if (dirEntry->attributes == 0x0f) {
-//      println("Long file");
-      dirEntry++;
+    if (entry->order == 0xe5) {
+      matching = 0;
       continue;
     }
 
-    ptr = (char*)dirEntry->filename;
-    // copy filename from directory entry
-    for (k=0; k<11; k++) {
-      filename[k] = *ptr++;
+    if (entry->attributes == 0x0f) {
+      uint32_t order = entry->order & 0x3f;
+      if (entry->order & 0x40) {
+        // first entry of a name holds its end
+        matching = order == entries;
+        expected = order;
+        checksum = entry->checksum;
+      } else if (order != expected || entry->checksum != checksum) {
+        matching = 0;
+      }
+      if (matching) {
+        matching = FAT_MatchLongEntry(entry, longName, length);
+        expected--;
+      }
+      continue;
     }
-    filename[11] = 0; // end string
-//    println("File name %s", filename);
-    if (!strcmp(filename, file->filename)) {
 
-      // get all the relevant information about the file
-      file->firstCluster = (((uint32_t)(dirEntry->firstClusterH))<<16) |
-          (uint32_t)dirEntry->firstClusterL;
-      file->fileSize = dirEntry->fileSize;
-      file->attributes = dirEntry->attributes;
-      file->lastModifiedTime = dirEntry->lastModifiedTime;
-      file->lastModifiedDate = dirEntry->lastModifiedDate;
-      file->id = FAT_GetNextId();
-      file->rootDirEntry = i-1;
-      println("%s, File root dir entry = %u", __FUNCTION__,
-          (unsigned int)file->rootDirEntry);
+    // short entry ends the name
+    if (matching && !expected &&
+        FAT_LongNameChecksum(((FAT_RootDirEntry*)entry)->filename) == checksum) {
+      memcpy(name, ((FAT_RootDirEntry*)entry)->filename, 11);
+      name[11] = 0;
+      return 0;
+    }
+    matching = 0;
+  }
 
-      FAT_DateFormat date;
-      date.date = file->lastModifiedDate;
+  LOG_INFO("%s: Long name %.*s not found", __FUNCTION__, (int)length, longName);
+  return -1;
+}
+/**
+ * @brief Selects the volume of a path.
+ * @param path Path, starting with the volume ID and a colon for
+ * volumes other than 0 (e.g. "1:/LOGS/DATA.BIN")
+ * @return Path without the volume ID or 0 if the volume isn't mounted.
+ */
+static const char* FAT_PathVolume(const char* path) {
 
-      FAT_TimeFormat time;
-      time.time = file->lastModifiedTime;
+  uint32_t volume = 0;
 
-      file->rdPtr = 0; // start reading from 1st byte
-      file->wrPtr = 0; // start writing from 1st byte
+  if (path[0] >= '0' && path[0] <= '9' && path[1] == ':') {
+    volume = path[0] - '0';
+    path += 2;
+  }
+  if (volume >= FAT_MAX_VOLUMES || !volumes[volume].mounted) {
+    LOG_INFO("%s: Volume %u not mounted", __FUNCTION__, (unsigned int)volume);
+    return 0;
+  }
+  vol = &volumes[volume];
+  return path;
+}
+/**
+ * @brief Finds the directory holding a file.
+ *
+ * @details Each directory on the path is looked up in its parent.
+ * Components which are valid 8.3 names are looked up by the short
+ * name, others by the long name. The file name is returned as the
+ * 8.3 name, of the matching entry for long names - only existing
+ * files can be given by a long name.
+ * The directory part of the path is remembered in the path cache, so
+ * later opens in the same directory don't walk it again. Directories
+ * can't be deleted or renamed, so cache entries never go stale.
+ *
+ * @param path Path of file, with or without the leading slash
+ * @param dirCluster First cluster of the directory holding the file
+ * (function writes this)
+ * @param name 8.3 name of the file, zero ended (function writes this)
+ * @retval 0 Directory found
+ * @retval -1 A directory on the path doesn't exist or a name is invalid
+ */
+static int FAT_ResolvePath(const char* path, uint32_t* dirCluster, char* name) {
 
-      println("%s: Found file %s of size %u, ID = %u!!!",
-          __FUNCTION__, file->filename, (unsigned int)file->fileSize,
-          (unsigned int)file->id);
-      println("%s: File created on %02u.%02u.%04u at %02u:%02u:%02u",
-          __FUNCTION__, date.fields.day,date.fields.month, date.fields.year+1980,
-          time.fields.hours, time.fields.minutes, time.fields.seconds*2);
+  FAT_PartitionInfo* part = &vol->part;
 
-      FAT_LongDirEntry *longEntry = (FAT_LongDirEntry *)(dirEntry - 1);
+  if (*path == '/') {
+    path++;
+  }
+  *dirCluster = part->rootDirCluster;
 
-      uint16_t longFilename[14];
+  const char* last = strrchr(path, '/');
 
-      uint16_t* namePtr = longFilename;
+  if (last) {
+    uint32_t length = last - path;
+    FAT_PathCacheEntry* entry = 0;
+    FAT_PathCacheEntry* victim = &vol->pathCache[0];
 
-      for (int i = 0; i < 5; i++) {
-        *namePtr++ = longEntry->name1[i];
+    for (int i = 0; i < FAT_PATH_CACHE_ENTRIES; i++) {
+      if (vol->pathCache[i].path[0] && length < FAT_PATH_CACHE_LENGTH &&
+          !strncmp(vol->pathCache[i].path, path, length) && !vol->pathCache[i].path[length]) {
+        entry = &vol->pathCache[i];
+        break;
       }
-      for (int i = 0; i < 6; i++) {
-        *namePtr++ = longEntry->name2[i];
+      if (vol->pathCache[i].lastUsed < victim->lastUsed) {
+        victim = &vol->pathCache[i];
       }
-      for (int i = 0; i < 2; i++) {
-        *namePtr++ = longEntry->name3[i];
+    }
+
+    if (entry) {
+      *dirCluster = entry->cluster;
+    } else {
+      const char* component = path;
+      while (component < last) {
+        const char* end = memchr(component, '/', last - component + 1);
+        uint32_t sector, index;
+
+        int found;
+        if (FAT_ShortName(component, end - component, name) == 0) {
+          found = FAT_DirLookup(*dirCluster, name, &sector, &index);
+        } else {
+          found = FAT_FindLongName(*dirCluster, component, end - component,
+              name, &sector, &index);
+        }
+        if (found == -1) {
+          LOG_INFO("%s: Directory %.*s not found", __FUNCTION__,
+              (int)(end - path), path);
+          return -1;
+        }
+        FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(sector);
+        dirEntry += index;
+        if (!(dirEntry->attributes & 0x10)) {
+          return -1; // not a directory
+        }
+        *dirCluster = (((uint32_t)dirEntry->firstClusterH) << 16) |
+            dirEntry->firstClusterL;
+        // ".." of a subdirectory of the root points at cluster 0
+        if (*dirCluster == 0) {
+          *dirCluster = part->rootDirCluster;
+        }
+        component = end + 1;
       }
-      *namePtr = 0;
-      println("%s: Long file name", __FUNCTION__);
-      hexdump16C(longFilename, 14);
 
-      return file->id;
+      if (length < FAT_PATH_CACHE_LENGTH) {
+        entry = victim;
+        memcpy(entry->path, path, length);
+        entry->path[length] = 0;
+        entry->cluster = *dirCluster;
+      }
+    }
+    if (entry) {
+      entry->lastUsed = ++vol->pathCacheStamp;
     }
-    dirEntry++;
+    path = last + 1;
   }
 
-  return -1;
+  if (FAT_ShortName(path, strlen(path), name) == 0) {
+    return 0;
+  }
+  // the file is opened by the 8.3 name of the matching entry
+  uint32_t sector, index;
+  return FAT_FindLongName(*dirCluster, path, strlen(path), name, &sector, &index);
+}
+/**
+ * @brief Finds a given file in a directory.
+ * @param file File with the 8.3 name filled in, the directory entry
+ * information is filled in if found. No file ID is taken.
+ * @param dirCluster First cluster of the directory
+ * @return 0 if found or -1 if not found.
+ */
+static int FAT_FindFile(FAT_File* file, uint32_t dirCluster) {
+
+  LOG_TRACE("%s: Searching for file %s", __FUNCTION__, file->filename);
+
+  uint32_t sector, index;
+
+  if (FAT_DirLookup(dirCluster, file->filename, &sector, &index) == -1) {
+    LOG_INFO("%s: File %s not found", __FUNCTION__, file->filename);
+    return -1;
+  }
+
+  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)FAT_ReadSector(sector);
+  dirEntry += index;
+
+  // get all the relevant information about the file
+  file->firstCluster = (((uint32_t)(dirEntry->firstClusterH))<<16) |
+      (uint32_t)dirEntry->firstClusterL;
+  file->fileSize = dirEntry->fileSize;
+  file->attributes = dirEntry->attributes;
+  file->lastModifiedTime = dirEntry->lastModifiedTime;
+  file->lastModifiedDate = dirEntry->lastModifiedDate;
+  file->dirSector = sector;
+  file->dirIndex = index;
+  LOG_TRACE("%s, File dir entry = %u in sector %u", __FUNCTION__,
+      (unsigned int)file->dirIndex, (unsigned int)file->dirSector);
+
+  file->rdPtr = 0; // start reading from 1st byte
+  file->wrPtr = 0; // start writing from 1st byte
+
+#if LOG_ENABLED(LOG_LEVEL_INFO)
+  FAT_DateFormat date;
+  date.date = file->lastModifiedDate;
+
+  FAT_TimeFormat time;
+  time.time = file->lastModifiedTime;
+
+  LOG_INFO("%s: Found file %s of size %u!!!",
+      __FUNCTION__, file->filename, (unsigned int)file->fileSize);
+  LOG_INFO("%s: File created on %02u.%02u.%04u at %02u:%02u:%02u",
+      __FUNCTION__, date.fields.day,date.fields.month, date.fields.year+1980,
+      time.fields.hours, time.fields.minutes, time.fields.seconds*2);
+#endif
+
+  return 0;
 }
 /**
  * @brief Finds next free ID of file.
@@ -1040,72 +4989,6 @@ static int FAT_GetNextId(void) {
   // if no free
   return -1;
 }
-/**
- * @brief Lists files in root directory of volume
- * TODO Finish this function. Used for tests for now
- */
-//static void FAT_ListRootDir(void) {
-//
-//  println("Root dir");
-//
-//  // read first sector of root dir
-//  phyCallbacks.phyReadSectors(buf,
-//      mountedDisks[0].partitionInfo[0].rootDirSector, 1);
-//
-//  FAT_RootDirEntry* dirEntry = (FAT_RootDirEntry*)buf;
-//
-//  char filename[12];
-//  char* ptr;
-//  int i, j;
-//
-//  // 16 entries in one sector
-//  for (i = 0; i< 16; i++) {
-//
-//    println("FILE %d:", i);
-//
-//    ptr = (char*)dirEntry->filename;
-//
-//    // check if file is empty
-//    if (dirEntry->filename[0] == 0x00 || dirEntry->filename[0] == 0xe5) {
-//      dirEntry++;
-//      continue;
-//    }
-//    if (dirEntry->attributes == 0x0f) {
-//      println("Long file");
-//      dirEntry++;
-//      continue;
-//    }
-//
-//    for (j=0; j<11; j++) {
-//      filename[j] = *ptr++;
-//    }
-//    filename[11] = 0;
-//
-//    println("Filename %s, attributes 0x%02x, file size %d",
-//        filename, (unsigned int)dirEntry->attributes,
-//        (unsigned int)dirEntry->fileSize);
-//
-//    if (!strcmp(filename, "HELLO   TXT")) {
-//      println("Found file %s!!!!", filename);
-//      uint8_t buf2[512];
-//      uint32_t cluster = (((uint32_t)(dirEntry->firstClusterH))<<16) |
-//          (uint32_t)dirEntry->firstClusterL;
-//      println("File is at cluster %d", (unsigned int)cluster);
-//      println("File is at sector %d", (unsigned int)FAT_Cluster2Sector(cluster));
-//      println("File size is %d",(unsigned int)dirEntry->fileSize);
-//
-//      phyCallbacks.phyReadSectors(buf2, FAT_Cluster2Sector(cluster), 1);
-//
-//      hexdump(buf2, 16);
-//      println("%s",buf2);
-//
-//      FAT_GetEntryInFAT(cluster);
-//    }
-//
-//    dirEntry++;
-//  }
-//
-//}
 
 /**
  * @}
@@ -18,17 +18,13 @@
 #include <fifo.h>
 #include <stdio.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef FIFO_LOG_LEVEL
+  #define FIFO_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf("FIFO--> "str"%s",##args,"\r")
-  #define println(str, args...) printf("FIFO--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL FIFO_LOG_LEVEL
+#define LOG_TAG   "FIFO"
+#include <log.h>
 
 /**
  * @addtogroup FIFO
@@ -49,7 +45,7 @@
 uint8_t FIFO_Add(FIFO_TypeDef* fifo) {
 
   if (fifo->len == 0 ) {
-    println("Zero FIFO length");
+    LOG_ERROR("Zero FIFO length");
     return 1;
   }
 
@@ -70,7 +66,7 @@ uint8_t FIFO_Push(FIFO_TypeDef* fifo, uint8_t c) {
 
   // Check for overflow
   if (fifo->count == fifo->len) {
-    println("FIFO overflow");
+    LOG_ERROR("FIFO overflow");
     return 1;
   }
 
@@ -95,7 +91,7 @@ uint8_t FIFO_Pop(FIFO_TypeDef* fifo, uint8_t* c) {
 
   // If FIFO is empty
   if (fifo->count == 0) {
-//    println("FIFO is empty");
+//    LOG_TRACE("FIFO is empty");
     return 1;
   }
   *c = fifo->buf[fifo->tail++];
@@ -20,17 +20,13 @@
 #include <stdio.h>
 #include <keys_hal.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef KEYS_LOG_LEVEL
+  #define KEYS_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf("KEYS--> "str"%s",##args,"\r")
-  #define println(str, args...) printf("KEYS--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL KEYS_LOG_LEVEL
+#define LOG_TAG   "KEYS"
+#include <log.h>
 
 /**
  * @addtogroup KEYS
@@ -110,7 +106,7 @@ uint8_t KEYS_Update(void) {
   if (!repeatFlag && keyId != KEY_NONE &&
       TIMER_DelayTimer(DEBOUNCE_TIME, debounceTimer)) {
     keyValid = keyId;
-    println("You pressed a key 0x%02x.", keyValid);
+    LOG_INFO("You pressed a key 0x%02x.", keyValid);
     lastKey = keyId; // store new last pressed key
     keyId = KEY_NONE;
     repeatTimer = TIMER_GetTime(); // start repeatTimer
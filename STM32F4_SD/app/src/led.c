@@ -29,17 +29,13 @@
 #include <led.h>
 #include <led_hal.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef LED_LOG_LEVEL
+  #define LED_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf("LED--> "str"%s",##args,"\r")
-  #define println(str, args...) printf("LED--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL LED_LOG_LEVEL
+#define LOG_TAG   "LED"
+#include <log.h>
 
 /**
  * @addtogroup LED
@@ -56,7 +52,7 @@ void LED_Init(LED_Number_TypeDef led) {
 
   // Check if LED number is correct.
   if (led >= MAX_LEDS) {
-    println("Error: Incorrect LED number %d!", (int)led);
+    LOG_ERROR("Error: Incorrect LED number %d!", (int)led);
     return;
   }
 
@@ -72,12 +68,12 @@ void LED_Init(LED_Number_TypeDef led) {
 void LED_ChangeState(LED_Number_TypeDef led, LED_State_TypeDef state) {
 
   if (led >= MAX_LEDS) {
-    println("Error: Incorrect LED number %d!", (int)led);
+    LOG_ERROR("Error: Incorrect LED number %d!", (int)led);
     return;
   }
 
   if (ledState[led] == LED_UNUSED) {
-    println("Error: Uninitialized LED %d!", (int)led);
+    LOG_ERROR("Error: Uninitialized LED %d!", (int)led);
     return;
   } else {
     if (state == LED_OFF) {
@@ -97,12 +93,12 @@ void LED_ChangeState(LED_Number_TypeDef led, LED_State_TypeDef state) {
 void LED_Toggle(LED_Number_TypeDef led) {
 
   if (led >= MAX_LEDS) {
-    println("Error: Incorrect LED number %d!", (int)led);
+    LOG_ERROR("Error: Incorrect LED number %d!", (int)led);
     return;
   }
 
   if (ledState[led] == LED_UNUSED) {
-    println("Error: Uninitialized LED %d!", (int)led);
+    LOG_ERROR("Error: Uninitialized LED %d!", (int)led);
     return;
   } else {
     if (ledState[led] == LED_OFF) {
@@ -26,17 +26,13 @@
  * @{
  */
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef SD_LOG_LEVEL
+  #define SD_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf(""str"%s",##args,"")
-  #define println(str, args...) printf("SD--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL SD_LOG_LEVEL
+#define LOG_TAG   "SD"
+#include <log.h>
 
 /*
  * SD commands (SPI command subset) as per SanDisk Secure Digital Card product manual.
@@ -66,6 +62,7 @@
  */
 #define SD_ACMD_SEND_OP_COND        41  ///< Activates the card initialization process, sends host capacity.
 #define SD_ACMD_SEND_SCR            51  ///< Reads SD Configuration register
+#define SD_ACMD_SET_WR_BLK_ERASE_COUNT 23 ///< Sets number of blocks to pre-erase before a multiple block write
 #define SD_SEND_NUM_WR_BLOCKS       22  ///< Gets number of well written blocks
 
 /*
@@ -280,7 +277,7 @@ void SD_Init(void) {
 
   // Check response errors
   if (resp.responseR1 != 0x01) {
-    println("GO_IDLE_STATE error");
+    LOG_ERROR("GO_IDLE_STATE error");
   }
 
   // send CMD8
@@ -292,16 +289,18 @@ void SD_Init(void) {
 
   // Check response errors
   if (resp.responseR1 != 0x01) {
-    println("SEND_IF_COND error");
+    LOG_ERROR("SEND_IF_COND error");
   }
 
   // Check if card supports given voltage range
   if ((buf[3] != SD_IF_COND_CHECK) || (buf[2] != (SD_IF_COND_VOLT>>8))) {
-    println("SEND_IF_COND error");
+    LOG_ERROR("SEND_IF_COND error");
+#if LOG_ENABLED(LOG_LEVEL_ERROR)
     for (i=0; i<4; i++) {
-      print("%02x ", buf[i]);
+      printf("%02x ", buf[i]);
     }
-    print("\r\n");
+    printf("\r\n");
+#endif
 
   }
 
@@ -310,7 +309,7 @@ void SD_Init(void) {
 
   // Check response errors
   if (resp.responseR1 != 0x01) {
-    println("READ_OCR error");
+    LOG_ERROR("READ_OCR error");
   }
 
   // Send ACMD41 until card goes out of IDLE state
@@ -326,7 +325,7 @@ void SD_Init(void) {
     }
 
     if (i == 9) {
-      println("Failed to initialize SD card");
+      LOG_ERROR("Failed to initialize SD card");
       while(1);
     }
   }
@@ -342,15 +341,15 @@ void SD_Init(void) {
   resp = SD_ReadOCR(&ocr);
 
   if (resp.responseR1 != 0x00) {
-    println("READ_OCR error");
+    LOG_ERROR("READ_OCR error");
   }
 
   // check capacity
   if (ocr.bits.cardCapacityStatus == 1) {
-    println("SDHC card connected");
+    LOG_INFO("SDHC card connected");
     isSDHC = 1;
   } else {
-    println("SDSC card connected");
+    LOG_INFO("SDSC card connected");
     isSDHC = 0;
   }
 
@@ -387,7 +386,7 @@ uint8_t SD_ReadSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
   resp.responseR1 = SD_SendCommand(SD_READ_MULTIPLE_BLOCK, sector);
 
   if (resp.responseR1 != 0x00) {
-    println("SD_READ_MULTIPLE_BLOCK error");
+    LOG_ERROR("SD_READ_MULTIPLE_BLOCK error");
     SD_HAL_DeselectCard();
     return 1;
   }
@@ -411,14 +410,21 @@ uint8_t SD_ReadSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
   return 0;
 }
 /**
- * @brief Write sectors to SD card
- * @param buf Data buffer
+ * @brief Writes blocks with one multiple block write command.
+ *
+ * @details The number of blocks is announced with ACMD23 first,
+ * so the card can erase them before the data arrives instead of
+ * erasing every block separately.
+ *
+ * @param buf Data buffer (count*512 bytes), used if bufs is 0
+ * @param bufs Separate 512 byte buffer for every block
  * @param sector First sector to write
  * @param count Number of sectors to write
- * @retval 0 Read was successful
+ * @retval 0 Write was successful
  * @retval 1 Error occurred
  */
-uint8_t SD_WriteSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
+static uint8_t SD_WriteMultiple(uint8_t* buf, uint8_t* const* bufs,
+    uint32_t sector, uint32_t count) {
 
   SD_ResponseR1 resp;
 
@@ -429,21 +435,28 @@ uint8_t SD_WriteSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
 
   SD_HAL_SelectCard();
 
+  if (count > 1) {
+    SD_SendCommand(SD_APP_CMD, 0);
+    resp.responseR1 = SD_SendCommand(SD_ACMD_SET_WR_BLK_ERASE_COUNT, count);
+    if (resp.responseR1 != 0x00) {
+      // not fatal - the card just won't pre-erase
+      LOG_WARN("SD_ACMD_SET_WR_BLK_ERASE_COUNT error");
+    }
+  }
+
   resp.responseR1 = SD_SendCommand(SD_WRITE_MULTIPLE_BLOCK, sector);
 
   if (resp.responseR1 != 0x00) {
-    println("SD_WRITE_MULTIPLE_BLOCK error");
+    LOG_ERROR("SD_WRITE_MULTIPLE_BLOCK error");
     SD_HAL_DeselectCard();
     return 1;
   }
 
-  while (count) {
-    SD_HAL_TransmitData(0xfc); // send start block token
-    SD_HAL_WriteBuffer(buf, 512);
+  for (uint32_t i = 0; i < count; i++) {
+    SD_HAL_TransmitData(SD_TOKEN_MBW_START); // send start block token
+    SD_HAL_WriteBuffer(bufs ? bufs[i] : buf + i*512, 512);
     SD_HAL_TransmitData(0xff);
     SD_HAL_TransmitData(0xff); // two bytes CRC
-    count--;
-    buf += 512; // move buffer pointer forward
 
     // data response
     SD_HAL_TransmitData(0xff);
@@ -451,7 +464,7 @@ uint8_t SD_WriteSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
     while(!SD_HAL_TransmitData(0xff)); // wait while card is busy
   }
 
-  SD_HAL_TransmitData(0xfd); // stop transmission token
+  SD_HAL_TransmitData(SD_TOKEN_MBW_STOP); // stop transmission token
   SD_HAL_TransmitData(0xff);
   while(!SD_HAL_TransmitData(0xff)); // wait while card is busy
 
@@ -459,6 +472,34 @@ uint8_t SD_WriteSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
 
   return 0;
 }
+/**
+ * @brief Write sectors to SD card
+ * @param buf Data buffer
+ * @param sector First sector to write
+ * @param count Number of sectors to write
+ * @retval 0 Write was successful
+ * @retval 1 Error occurred
+ */
+uint8_t SD_WriteSectors(uint8_t* buf, uint32_t sector, uint32_t count) {
+
+  return SD_WriteMultiple(buf, 0, sector, count);
+}
+/**
+ * @brief Write sectors held in separate buffers to SD card
+ *
+ * @details Consecutive sectors scattered in memory (e.g. in
+ * a sector cache) are written in one transfer.
+ *
+ * @param bufs Buffers of consecutive sectors, 512 bytes each
+ * @param sector First sector to write
+ * @param count Number of sectors to write
+ * @retval 0 Write was successful
+ * @retval 1 Error occurred
+ */
+uint8_t SD_WriteSectorsV(uint8_t* const* bufs, uint32_t sector, uint32_t count) {
+
+  return SD_WriteMultiple(0, bufs, sector, count);
+}
 /**
  * @brief Reads OCR register
  *
@@ -486,11 +527,13 @@ static SD_ResponseR1 SD_ReadOCR(SD_OCR* ocr) {
   *ptr = ntohl(*ptrBuf); // convert to little endian if necessary
 
   // Send OCR to terminal
-  print("OCR value: ");
+#if LOG_ENABLED(LOG_LEVEL_INFO)
+  printf("OCR value: ");
   for (int i = 0; i < 4; i++) {
-    print("%02x ", tmp[i]);
+    printf("%02x ", tmp[i]);
   }
-  print("\r\n");
+  printf("\r\n");
+#endif
 
   return resp;
 }
@@ -506,7 +549,7 @@ static void SD_ReadCID(SD_CID* cid) {
   resp.responseR1 = SD_SendCommand(SD_SEND_CID, 0);
 
   if (resp.responseR1 != 0x00) {
-    println("SD_SEND_CID error");
+    LOG_ERROR("SD_SEND_CID error");
     return;
   }
 
@@ -522,7 +565,9 @@ static void SD_ReadCID(SD_CID* cid) {
     ptr[i] = buf[i];
   }
 
+#if LOG_ENABLED(LOG_LEVEL_INFO)
   hexdumpC(buf, 16);
+#endif
 
   // R1b response - check busy flag
   while(!SD_HAL_TransmitData(0xff));
@@ -544,7 +589,7 @@ static void SD_ReadCSD(SD_CSD* csd) {
   resp.responseR1 = SD_SendCommand(SD_SEND_CSD, 0);
 
   if (resp.responseR1 != 0x00) {
-    println("SD_SEND_CSD error");
+    LOG_ERROR("SD_SEND_CSD error");
     return;
   }
 
@@ -562,16 +607,18 @@ static void SD_ReadCSD(SD_CSD* csd) {
     ptr[i] = ntohl(ptrBuf[3-i]); // convert to little endian if necessary
   }
 
+#if LOG_ENABLED(LOG_LEVEL_INFO)
   hexdumpC(buf, 16);
+#endif
 
-  println("CSD type: 0x%02x", (unsigned int) csd->csdType);
-  println("CSD device size: %u", (unsigned int) csd->deviceSize);
+  LOG_INFO("CSD type: 0x%02x", (unsigned int) csd->csdType);
+  LOG_INFO("CSD device size: %u", (unsigned int) csd->deviceSize);
 
   // size counted in blocks of 512K
   cardCapacity = csd->deviceSize * 512 * 1024;
   // the newlib implementation of printf seems to have problems
   // with %llu format
-  println("Card capacity: %u", (unsigned int)cardCapacity);
+  LOG_INFO("Card capacity: %u", (unsigned int)cardCapacity);
 
   // R1b response - check busy flag
   while(!SD_HAL_TransmitData(0xff));
@@ -611,7 +658,7 @@ static uint8_t SD_SendCommand(uint8_t cmd, uint32_t args) {
   // So, we send a dummy byte first.
   SD_HAL_TransmitData(0xff);
   uint8_t ret = SD_HAL_TransmitData(0xff);
-//  println("Response to cmd %d is %02x", cmd, ret);
+//  LOG_TRACE("Response to cmd %d is %02x", cmd, ret);
 
   return ret;
 }
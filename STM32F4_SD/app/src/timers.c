@@ -24,17 +24,13 @@
 #include <systick.h>
 #include <timer14.h>
 
-#ifndef DEBUG
-  #define DEBUG
+#ifndef TIMERS_LOG_LEVEL
+  #define TIMERS_LOG_LEVEL LOG_LEVEL_DEFAULT
 #endif
 
-#ifdef DEBUG
-  #define print(str, args...) printf("LED--> "str"%s",##args,"\r")
-  #define println(str, args...) printf("LED--> "str"%s",##args,"\r\n")
-#else
-  #define print(str, args...) (void)0
-  #define println(str, args...) (void)0
-#endif
+#define LOG_LEVEL TIMERS_LOG_LEVEL
+#define LOG_TAG   "TIMER"
+#include <log.h>
 
 /**
  * @addtogroup TIMER
@@ -156,7 +152,7 @@ uint8_t TIMER_DelayTimer(uint32_t ms, uint32_t startTime) {
 int8_t TIMER_AddSoftTimer(uint32_t maxVal, void (*fun)(void)) {
 
   if (softTimerCount > MAX_SOFT_TIMERS) {
-    println("TIMERS: Reached maximum number of timers!");
+    LOG_ERROR("TIMERS: Reached maximum number of timers!");
     return -1;
   }
 
@@ -0,0 +1,187 @@
+/**
+ * @file    fatbench.c
+ * @brief   Host benchmark of the FAT read and write loops.
+ *
+ * Formats a FAT32 volume holding one 200000 byte file on a RAM disk,
+ * then reads and overwrites the file in chunks of several sizes. The
+ * RAM disk costs little more than a memcpy, so the time measured is
+ * mostly spent in FAT_ReadFile and FAT_WriteFile.
+ *
+ * To compare two versions of the driver, build the benchmark against
+ * each of them. Only functions present since the first sector cache
+ * are used. Versions older than log.h always print debug messages,
+ * remove their DEBUG define first.
+ *
+ * Build and run from this directory:
+ *
+ * @code
+ * gcc -std=gnu11 -O0 -DLOG_LEVEL_DEFAULT=LOG_LEVEL_NONE -I../../app/inc \
+ *     -o fatbench fatbench.c ../../app/src/fat.c ../../app/src/utils.c
+ * ./fatbench 3000
+ * @endcode
+ *
+ * -O0 matches the Release configuration of the project. The optional
+ * argument is the clock of the host CPU in MHz, used to print cycles
+ * per byte as well as nanoseconds.
+ */
+
+#include <fat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DISK_SECTORS      65536 ///< Size of the RAM disk (32 MiB)
+#define PART_START        2048  ///< First sector of the partition
+#define SECTORS_PER_CLUSTER 8
+#define RESERVED_SECTORS  32
+#define FILE_SIZE         200000 ///< Size of the benchmarked file
+#define PASSES            200    ///< Reads and overwrites of the whole file per chunk size
+
+static uint8_t* disk; ///< RAM disk
+static uint8_t data[FILE_SIZE];
+
+uint32_t TIMER_GetTime(void) {
+  return 0;
+}
+
+static void diskInit(void) {
+}
+
+static uint8_t diskRead(uint8_t* buf, uint32_t sector, uint32_t count) {
+  memcpy(buf, disk + (size_t)sector * 512, count * 512);
+  return 0;
+}
+
+static uint8_t diskWrite(uint8_t* buf, uint32_t sector, uint32_t count) {
+  memcpy(disk + (size_t)sector * 512, buf, count * 512);
+  return 0;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+/**
+ * @brief Formats the RAM disk with one FAT32 partition.
+ *
+ * @details The root directory holds BENCH.BIN, stored in adjacent
+ * clusters after the root directory cluster.
+ */
+static void diskFormat(void) {
+
+  uint32_t length = DISK_SECTORS - PART_START;
+  uint32_t fatSectors = (length / SECTORS_PER_CLUSTER + 2) * 4 / 512 + 1;
+
+  disk = calloc(DISK_SECTORS, 512);
+
+  uint8_t* mbr = disk;
+  mbr[446 + 4] = 0x0b; // FAT32
+  put32(&mbr[446 + 8], PART_START);
+  put32(&mbr[446 + 12], length);
+  put16(&mbr[510], 0xaa55);
+
+  uint8_t* boot = disk + PART_START * 512;
+  memcpy(boot, "\xeb\x58\x90" "MSWIN4.1", 11);
+  put16(&boot[11], 512);
+  boot[13] = SECTORS_PER_CLUSTER;
+  put16(&boot[14], RESERVED_SECTORS);
+  boot[16] = 2;
+  boot[21] = 0xf8;
+  put32(&boot[32], length);
+  put32(&boot[36], fatSectors);
+  put32(&boot[44], 2); // root directory cluster
+  put16(&boot[48], 1); // FSInfo sector
+  boot[66] = 0x29;
+  memcpy(&boot[82], "FAT32   ", 8);
+  put16(&boot[510], 0xaa55);
+
+  uint8_t* fsInfo = boot + 512;
+  put32(&fsInfo[0], 0x41615252);
+  put32(&fsInfo[484], 0x61417272);
+  put32(&fsInfo[488], 0xffffffff);
+  put32(&fsInfo[492], 0xffffffff);
+  put32(&fsInfo[508], 0xaa550000);
+
+  uint32_t clusterSize = SECTORS_PER_CLUSTER * 512;
+  uint32_t clusters = (FILE_SIZE + clusterSize - 1) / clusterSize;
+
+  for (int i = 0; i < 2; i++) {
+    uint8_t* fat = boot + (RESERVED_SECTORS + i * fatSectors) * 512;
+    put32(&fat[0], 0x0ffffff8);
+    put32(&fat[4], 0x0fffffff);
+    put32(&fat[8], 0x0fffffff); // root directory
+    for (uint32_t c = 3; c < 3 + clusters; c++) {
+      put32(&fat[c * 4], c + 1 < 3 + clusters ? c + 1 : 0x0fffffff);
+    }
+  }
+
+  uint8_t* root = boot + (RESERVED_SECTORS + 2 * fatSectors) * 512;
+  memcpy(root, "BENCH   BIN", 11);
+  root[11] = 0x20; // archive
+  put16(&root[26], 3); // first cluster
+  put32(&root[28], FILE_SIZE);
+
+  for (int i = 0; i < FILE_SIZE; i++) {
+    root[clusterSize + i] = i;
+  }
+}
+
+static double now(void) {
+
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+
+  static const int chunks[] = {37, 100, 511, 4096};
+  double mhz = argc > 1 ? atof(argv[1]) : 0;
+
+  diskFormat();
+  if (FAT_Init(diskInit, diskRead, diskWrite)) {
+    printf("Mount failed\n");
+    return 1;
+  }
+
+  int file = FAT_OpenFile("BENCH   BIN");
+  FAT_AttachFileBuffer(file);
+
+  printf("chunk    ns/byte%s\n", mhz ? "  cycles/byte" : "");
+
+  for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+    int chunk = chunks[c];
+    double bytes = 0;
+    double start = now();
+
+    for (int pass = 0; pass < PASSES; pass++) {
+      int n;
+      FAT_MoveRdPtr(file, 0);
+      while ((n = FAT_ReadFile(file, data, chunk)) > 0) {
+        bytes += n;
+      }
+      FAT_MoveWrPtr(file, 0);
+      for (int pos = 0; pos < FILE_SIZE; pos += chunk) {
+        bytes += FAT_WriteFile(file, data,
+            chunk < FILE_SIZE - pos ? chunk : FILE_SIZE - pos);
+      }
+    }
+
+    double ns = (now() - start) * 1e9 / bytes;
+    if (mhz) {
+      printf("%5d  %9.2f  %11.2f\n", chunk, ns, ns * mhz / 1000);
+    } else {
+      printf("%5d  %9.2f\n", chunk, ns);
+    }
+  }
+
+  FAT_CloseFile(file);
+  return 0;
+}